@@ -27,33 +27,81 @@
 #ifndef TEXTCAT_H
 #define TEXTCAT_H
 
-#include <cstring>
-
-#ifdef HAVE_TEXTCAT
-  #ifdef HAVE_OLD_TEXTCAT
-    #ifdef __cplusplus
-extern "C" {
-    #endif
-  #endif
-#include "textcat.h"
-  #ifdef HAVE_OLD_TEXTCAT
-    #ifdef __cplusplus
-}
-   #endif
-  #endif
-#endif
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include "unicode/unistr.h"
+
+struct ustring_hash {
+  size_t operator()( const icu::UnicodeString& us ) const {
+    return us.hashCode();
+  }
+};
+
+// A character n-gram language guesser, after Cavnar & Trenkle, as used
+// in libtextcat. It reads the same configuration and fingerprint (.lm)
+// files, but all classification is done on const data, so one TextCat
+// can be shared by several threads. The models themselves are loaded only
+// once per configuration file, and shared by all TextCat objects using it.
+
+struct lang_score {
+  std::string lang;
+  int score;  // 'out of place' distance. lower is better
+};
 
 class TextCat {
  public:
   explicit TextCat( const std::string& );
-  TextCat( const TextCat& );
+  TextCat( const TextCat& ) = delete;
+  TextCat& operator=( const TextCat& ) = delete;
   ~TextCat();
-  bool isInit() const { return TC != 0; };
+  bool isInit() const { return !active.empty(); };
   std::string get_language( const std::string& ) const;
   std::vector<std::string> get_languages( const std::string& ) const;
+  std::string get_language( const icu::UnicodeString& ) const;
+  std::vector<std::string> get_languages( const icu::UnicodeString& ) const;
+  std::vector<lang_score> get_scores( const icu::UnicodeString& ) const;
+  std::string get_language( const icu::UnicodeString&, double& ) const;
+  void set_languages( const std::vector<std::string>& );
  private:
-  void *TC;
+  typedef std::unordered_map<icu::UnicodeString,int,ustring_hash> fingerprint;
+  struct lang_model {
+    std::string lang;
+    fingerprint ranks; // n-gram -> rank
+  };
+  typedef std::vector<lang_model> model_list;
+  static std::shared_ptr<const model_list> load_models( const std::string& );
+  static void load_model( model_list&, const std::string&, const std::string& );
+  fingerprint make_fingerprint( const icu::UnicodeString& ) const;
+  std::vector<lang_score> score_all( const icu::UnicodeString&, bool ) const;
+  std::shared_ptr<const model_list> models;
+  std::vector<const lang_model*> active; // the models we score against
   std::string cfName;
 };
 
+// A bounded (LRU) cache of language guesses, keyed on the (lowercased)
+// text. Repeated lines are very common in e.g. social media data.
+class LangCache {
+ public:
+  explicit LangCache( size_t s = 10000 ): max_size(s), hits(0), misses(0) {};
+  bool lookup( const icu::UnicodeString&, std::vector<std::string>& );
+  void store( const icu::UnicodeString&, const std::vector<std::string>& );
+  void set_size( size_t );
+  void clear();
+  size_t get_size() const { return max_size; };
+  size_t get_hits() const { return hits; };
+  size_t get_misses() const { return misses; };
+ private:
+  typedef std::pair<icu::UnicodeString,std::vector<std::string>> entry;
+  std::list<entry> lru; // most recently used first
+  std::unordered_map<icu::UnicodeString,
+		     std::list<entry>::iterator,
+		     ustring_hash> index;
+  size_t max_size;
+  size_t hits;
+  size_t misses;
+};
+
 #endif // TEXTCAT_H
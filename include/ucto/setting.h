@@ -27,9 +27,13 @@
 #ifndef UCTO_SETTING_H
 #define UCTO_SETTING_H
 
+#include <map>
+#include <mutex>
+#include <exception>
+#include "unicode/regex.h"
+
 namespace TiCC {
   class LogStream;
-  class UnicodeRegexMatcher;
   class UniFilter;
 }
 
@@ -40,23 +44,44 @@ namespace Tokenizer {
   class Rule {
     friend std::ostream& operator<< (std::ostream&, const Rule& );
   public:
-  Rule(): regexp(0){
+  Rule(): regexp(0), time_limit(0), timed_out(false){
     };
     Rule( const UnicodeString& id, const UnicodeString& pattern);
     ~Rule();
     UnicodeString id;
     UnicodeString pattern;
-    TiCC::UnicodeRegexMatcher *regexp;
+    RegexMatcher *regexp;
     bool matchAll( const UnicodeString&,
 		   UnicodeString&,
 		   UnicodeString&,
 		   std::vector<UnicodeString>& );
+    // limit the work of one match, in ICU match steps (about 1 ms). 0 is none
+    void setTimeLimit( int32_t );
+    int32_t time_limit;
+    bool timed_out; // the last matchAll() hit the time limit
   private:
     Rule( const Rule& ); // inhibit copies
     Rule& operator=( const Rule& ); // inhibit copies
   };
 
 
+  class RuleCache {
+    // compiled Rules, shared between the Settings of one tokenizer, so
+    // identical rules in different languages are compiled only once.
+    // Rules keep match state, so don't share a cache between threads
+    // that tokenize concurrently.
+  public:
+    RuleCache() {};
+    ~RuleCache();
+    Rule *get( const UnicodeString&, const UnicodeString& );
+    size_t size() const { return rules.size(); };
+  private:
+    RuleCache( const RuleCache& ); // inhibit copies
+    RuleCache& operator=( const RuleCache& ); // inhibit copies
+    std::map<std::pair<UnicodeString,UnicodeString>,Rule*> rules;
+    std::mutex lock;
+  };
+
   class Quoting {
     friend std::ostream& operator<<( std::ostream&, const Quoting& );
     struct QuotePair {
@@ -69,6 +94,7 @@ namespace Tokenizer {
     UnicodeString lookupClose( const UnicodeString & ) const;
     bool empty() const { return _quotes.empty(); };
     bool emptyStack() const { return quotestack.empty(); };
+    size_t stackSize() const { return quotestack.size(); };
     void clearStack() { quoteindexstack.clear(); quotestack.clear(); };
     int lookup( const UnicodeString&, int& );
     void eraseAtPos( int pos ) {
@@ -88,8 +114,14 @@ namespace Tokenizer {
 
   class Setting {
   public:
+  Setting(): tokDebug(0), theErrLog(0), rule_cache(0), time_limit(0),
+      pending(false) {};
     ~Setting();
-    bool read( const std::string&, const std::string&, int, TiCC::LogStream* );
+    Setting *clone() const;
+    bool read( const std::string&, const std::string&, int, TiCC::LogStream*,
+	       bool = false );
+    void compile();
+    bool isCompiled() const { return !pending; };
     bool readrules( const std::string& );
     bool readfilters( const std::string& );
     bool readquotes( const std::string& );
@@ -110,6 +142,14 @@ namespace Tokenizer {
     std::string version;  // the version of the datafile
     int tokDebug;
     TiCC::LogStream *theErrLog;
+    RuleCache *rule_cache; // when set, it owns our Rules
+    void setTimeLimit( int32_t );
+    int32_t time_limit;    // of all our Rules
+  private:
+    Rule *new_rule( const UnicodeString&, const UnicodeString& );
+    bool pending;         // a lazy read() still has to be done
+    std::exception_ptr compile_error; // why that read() failed
+    std::string add_file; // the additional tokens for a pending read()
   };
 
 } // namespace Tokenizer
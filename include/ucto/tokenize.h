@@ -30,6 +30,7 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include "libfolia/folia.h"
@@ -38,6 +39,7 @@
 #include "ucto/setting.h"
 
 class TextCat;
+class LangCache;
 
 namespace Tokenizer {
 
@@ -55,7 +57,8 @@ namespace Tokenizer {
     BEGINQUOTE                  = 16,
     ENDQUOTE                    = 32,
     TEMPENDOFSENTENCE           = 64,
-    LINEBREAK                   = 128
+    LINEBREAK                   = 128,
+    FALLBACK                    = 256  // not tokenized by the rules
   };
 
   std::ostream& operator<<( std::ostream&, const TokenRole& );
@@ -93,6 +96,43 @@ namespace Tokenizer {
     std::string typetostring();
   };
 
+  struct RuleStats {
+    // what a Rule cost us in tokenizeWord()
+  RuleStats(): attempts(0), matches(0), timeouts(0), seconds(0.0) {};
+    size_t attempts;
+    size_t matches;
+    size_t timeouts; // matches that hit the time limit
+    double seconds; // time spent in Rule::matchAll()
+  };
+
+  struct TokenizerStats {
+    // a snapshot of what a TokenizerClass did so far. see getStats()
+  TokenizerStats(): lines(0), tokens(0), sentences(0), buffered_tokens(0),
+      quote_depth(0), long_words(0), invalid_lines(0), rule_timeouts(0),
+      fallback_lines(0), fallback_tokens(0),
+      normalize_sec(0.0), filter_sec(0.0), tokenize_sec(0.0),
+      sentence_sec(0.0), output_sec(0.0) {};
+    TokenizerStats& operator+=( const TokenizerStats& );
+    size_t lines;           // input lines read
+    size_t tokens;          // tokens produced
+    size_t sentences;       // sentences flushed from the token buffer
+    size_t buffered_tokens; // tokens still waiting in the buffer
+    size_t quote_depth;     // unresolved quotes on the quote stack(s)
+    size_t long_words;      // long words handled by the long-word policy
+    size_t invalid_lines;   // lines skipped for invalid UTF-8
+    size_t rule_timeouts;   // Rule matches given up on the time limit
+    size_t fallback_lines;  // lines that exceeded the line budget
+    size_t fallback_tokens; // tokens made by the fallback
+    // the time spent in every phase
+    double normalize_sec;
+    double filter_sec;
+    double tokenize_sec;
+    double sentence_sec;
+    double output_sec;
+  };
+
+  std::ostream& operator<<( std::ostream&, const TokenizerStats& );
+
   class TokenizerClass{
   protected:
     int linenum;
@@ -131,6 +171,10 @@ namespace Tokenizer {
     //Tokenize from input file to output file (support xmlin + xmlout)
     void tokenize( const std::string&, const std::string& );
 
+    //Tokenize a FoLiA file to an output stream, element by element
+    // without loading the whole document in memory
+    void tokenizeStreaming( const std::string&, std::ostream& );
+
     //Tokenize from input stream to output stream
     void tokenize( std::istream&, std::ostream& );
     void tokenize( std::istream* in, std::ostream* out){
@@ -179,6 +223,14 @@ namespace Tokenizer {
     bool setPassThru( bool b=true ) { bool t = passthru; passthru = b; return t; };
     bool getPassThru() const { return passthru; }
 
+    //Enable streaming mode for FoLiA input
+    bool setStreaming( bool b=true ) { bool t = streaming; streaming = b; return t; };
+    bool getStreaming() const { return streaming; }
+
+    //set the number of threads used to tokenize a FoLiA document
+    int setNumThreads( int n ) { int t = numThreads; numThreads = (n<1?1:n); return t; };
+    int getNumThreads() const { return numThreads; }
+
     //Enable conversion of all output to uppercase
     bool setUppercase( bool b=true ) { bool t = uppercase; uppercase = b; if (b) lowercase = false; return t; };
     bool getUppercase() const { return uppercase; }
@@ -199,6 +251,74 @@ namespace Tokenizer {
     bool setLangDetection( bool b=true ) { bool t = doDetectLang; doDetectLang = b; return t; }
     bool getLangDetection() const { return doDetectLang; }
 
+    // set the unit of language detection on text input: 'line',
+    // 'paragraph', 'document' or a number of characters. Input is streamed,
+    // so a line gets the language guessed from the unit up to and including
+    // that line. Only the first 256 characters of a unit decide, after that
+    // its language doesn't change
+    std::string setLangDetectUnit( const std::string& );
+    std::string getLangDetectUnit() const { return detect_unit; };
+
+    // keep the current language as long as detection doesn't rule it out
+    bool setStickyLang( bool b=true ) { bool t = sticky_lang; sticky_lang = b; return t; };
+    bool getStickyLang() const { return sticky_lang; };
+
+    // only compile the settings of a language when it is first used
+    bool setLazySettings( bool b=true ) { bool t = lazy_settings; lazy_settings = b; return t; };
+    bool getLazySettings() const { return lazy_settings; };
+
+    // profile the Rules used in tokenizeWord()
+    bool setRuleProfiling( bool b=true ) { bool t = profile_rules; profile_rules = b; return t; };
+    bool getRuleProfiling() const { return profile_rules; };
+    const std::map<UnicodeString,RuleStats>& getRuleProfile() const { return rule_profile; };
+    // the number of tokenizeWord() calls per recursion depth
+    const std::vector<size_t>& getDepthProfile() const { return depth_profile; };
+    void printRuleProfile( std::ostream& ) const;
+
+    // limit the work per Rule match, in ICU match steps (about 1 ms each)
+    // a match that takes longer counts as no match. 0 means: no limit
+    int setRuleTimeLimit( int l ) { int t = rule_time_limit; rule_time_limit = l; return t; };
+    int getRuleTimeLimit() const { return rule_time_limit; };
+
+    // when tokenizing a line takes more than this many milliseconds, the
+    // rest of it is split on spaces only, and those tokens get the role
+    // FALLBACK. 0 means: always use the fallback. A negative value means:
+    // no budget, which is the default
+    double setLineBudget( double ms ) { double t = line_budget; line_budget = ms; return t; };
+    double getLineBudget() const { return line_budget; };
+
+    // read input lines of over 'bytes' bytes in pieces, cut at a space
+    // when possible, so a huge line doesn't need to be in memory at once,
+    // and its sentences are output as soon as they are complete. Each
+    // piece is tokenized as a line of its own. 0 means: read whole lines,
+    // the default
+    size_t setLineChunkSize( size_t bytes ) { size_t t = line_chunk_size; line_chunk_size = bytes; return t; };
+    size_t getLineChunkSize() const { return line_chunk_size; };
+
+    // what to do with a word of over 2500 characters:
+    //  'line'  : skip the whole line (the default)
+    //  'skip'  : skip only that word
+    //  'chunk' : split it in pieces of 2500, of type LONGWORD, without
+    //            running the rules on it
+    // returns the old policy. throws on an unknown one
+    std::string setLongWordPolicy( const std::string& );
+    const std::string& getLongWordPolicy() const { return long_word_policy; };
+
+    // write the lines (or FoLiA elements) that take more than 'ms'
+    // milliseconds to tokenize to 'file'. one line per input, tab separated:
+    //   milliseconds, line:number or id, slowest rule, its milliseconds, text
+    // so the texts can be fed to ucto again with: cut -f5-
+    // An empty filename stops logging. returns false when file can't be opened
+    bool setSlowLog( const std::string& file, double ms );
+
+    // what we did so far. cheap enough to call at any time
+    TokenizerStats getStats() const;
+    void resetStats() { stats = TokenizerStats(); };
+
+    // the cache of language guesses. (size 0 disables it)
+    void setLangCacheSize( size_t );
+    bool getLangCacheStats( size_t&, size_t& ) const;
+
     //Enable filtering
     bool setFiltering( bool b=true ) {
       bool t = doFilter; doFilter = b; return t;
@@ -270,13 +390,33 @@ namespace Tokenizer {
 
     void outputTokens( std::ostream&, const std::vector<Token>& ,const bool continued=false) const; //continued should be set to true when outputTokens is invoked multiple times and it is not the first invokation
   private:
+    struct ElementJob {
+      // a FoLiA element to be tokenized, or only to be fixed up (no lang)
+      folia::FoliaElement *element;
+      std::string lang;
+      UnicodeString text;
+      std::vector<Token> result;
+    };
+    struct LangContext {
+      // what the per-character and per-word code needs of one language.
+      // resolved once per line or element, instead of using settings[lang]
+      std::string lang;  // as given to the Tokens
+      Setting *set;
+      const std::vector<Rule *> *rules;
+      const UnicodeString *eosmarkers;
+      Quoting *quotes;
+      TiCC::UniFilter *filter;
+    };
+    LangContext get_context( const std::string& );
+    const UnicodeString& prepare_line( const UnicodeString&,
+				       const LangContext& );
     TokenizerClass( const TokenizerClass& ); // inhibit copies
     TokenizerClass& operator=( const TokenizerClass& ); // inhibit copies
     void add_rule( const UnicodeString&,
 		   const std::vector<UnicodeString>& );
     void tokenizeWord( const UnicodeString&,
 		       bool,
-		       const std::string&,
+		       const LangContext&,
 		       const UnicodeString& ="" );
     int tokenizeLine( const UnicodeString&,
 		      const std::string&,
@@ -284,28 +424,54 @@ namespace Tokenizer {
 
     bool detectEos( size_t, const UnicodeString&, const Quoting& ) const;
     void detectSentenceBounds( const int offset,
-			       const std::string& = "default" );
+			       const LangContext& );
     void detectQuotedSentenceBounds( const int offset,
-				     const std::string& = "default" );
+				     const LangContext& );
     void detectQuoteBounds( const int,
 			    Quoting& );
     //Signal the tokeniser that a paragraph is detected
     void signalParagraph( bool b=true ) { paragraphsignal = b; };
 
+    void fallbackWord( const UnicodeString&, bool, const LangContext& );
+    void log_slow_line( const UnicodeString&, const std::string&,
+			const LangContext&, double );
     bool resolveQuote( int, const UnicodeString&, Quoting& );
     bool u_isquote( UChar32,
 		    const Quoting& ) const;
     std::string checkBOM( std::istream& );
     void outputTokensDoc_init( folia::Document& ) const;
+    void tokenizeDoc_init( folia::Document& );
 
     int outputTokensXML( folia::FoliaElement *,
 			 const std::vector<Token>& ,
 			 int = 0 ) const;
-    void tokenizeElement( folia::FoliaElement * );
+    void tokenizeElement( folia::FoliaElement *,
+			  std::vector<ElementJob> * = 0 );
     void tokenizeSentenceElement( folia::FoliaElement *,
-				  const std::string& );
+				  const std::string&,
+				  const UnicodeString& );
+    std::vector<Token> tokenizeElementText( const UnicodeString&,
+					    const std::string&,
+					    const std::string& );
+    void declareTokens( folia::Document *, const std::string& );
+    std::string detect_language( const UnicodeString& );
+    std::string classify_language( const UnicodeString&, double& ) const;
+    std::vector<std::string> guess_languages( const UnicodeString& ) const;
+    TextCat *get_textcat() const;
+    void resetLangDetection( bool = false );
+    void declareOnce( folia::Document *,
+		      folia::AnnotationType::AnnotationType,
+		      const std::string&,
+		      const std::string& ) const;
+    void fixupText( folia::FoliaElement * );
+    void tokenizeParallel( folia::Document& );
+    TokenizerClass *createWorker() const;
 
     TiCC::UnicodeNormalizer normalizer;
+    // reusable buffers of prepare_line()
+    UnicodeString norm_buffer;
+    UnicodeString filter_buffer;
+    std::vector<unsigned char> char_classes; // for every character of a line
     std::string inputEncoding;
 
     UnicodeString eosmark;
@@ -343,6 +509,18 @@ namespace Tokenizer {
     //has do we attempt to assign languages?
     bool doDetectLang;
 
+    // language detection on text input: per line, paragraph, document
+    // or per detect_chars characters.
+    std::string detect_unit;
+    size_t detect_chars;
+    bool sticky_lang;
+    std::string detected_lang; // the language of the current unit
+    std::string last_lang;     // the language of the previous unit
+    UnicodeString detect_text; // the text we based detected_lang on
+    size_t unit_size;          // characters seen in the current unit
+    bool lang_confident;       // sticky: last_lang was a confident guess
+    size_t unchecked_size;     // sticky: characters seen since the guess
+
     //has do we percolate text up from <w> to <s> and <p> nodes? (FoLiA)
     // values should be: 'full', 'minimal' or 'none'
     std::string text_redundancy;
@@ -357,11 +535,37 @@ namespace Tokenizer {
     bool xmlout;
     bool xmlin;
     bool passthru;
+    bool streaming;
+    bool lazy_settings;
+    bool profile_rules;
+    int rule_time_limit;
+    double line_budget; // milliseconds per line
+    std::string long_word_policy;
+    size_t line_chunk_size; // bytes
+    bool line_continued; // the last piece read was not the end of its line
+    std::shared_ptr<std::ostream> slow_log; // shared with our workers
+    double slow_threshold;                  // milliseconds
+    std::vector<double> line_rule_seconds;  // per Rule of the current line
+    std::string line_id; // FoLiA id of the current line. empty for text
+    int word_depth; // current nesting of tokenizeWord()
+    std::map<UnicodeString,RuleStats> rule_profile;
+    std::vector<size_t> depth_profile;
+    mutable TokenizerStats stats; // also updated by the const output functions
+    int numThreads;
+
+    // the annotations (type,set) already declared in declared_doc
+    mutable const folia::Document *declared_doc;
+    mutable std::set<std::pair<int,std::string>> declared;
 
     std::string docid; //document ID (UTF-8), necessary for XML output
     std::string inputclass; // class for folia text
     std::string outputclass; // class for folia text
-    TextCat *tc;
+    // TextCat and its cache are only created when we need to guess
+    mutable TextCat *tc;
+    mutable LangCache *lang_cache;
+    size_t lang_cache_size;
+    std::vector<std::string> tc_languages; // the languages TextCat may guess
+    RuleCache *rule_cache; // the compiled Rules of all our settings
   };
 
   template< typename T >
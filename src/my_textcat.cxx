@@ -25,66 +25,307 @@
 */
 #include <string>
 #include <vector>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <cstdlib>
+#include <stdexcept>
+#include "unicode/uchar.h"
 #include "ticcutils/StringOps.h"
+#include "ticcutils/Unicode.h"
 #include "config.h"
 #include "ucto/my_textcat.h"
 
 using namespace std;
+using namespace icu;
 
-#ifdef HAVE_TEXTCAT
-TextCat::~TextCat() { textcat_Done( TC ); }
+// the same limits as libtextcat uses
+const size_t MAXNGRAMS = 400;    // size of a fingerprint
+const int MAXNGRAMSIZE = 5;      // longest n-gram
+const int MINDOCSIZE = 25;       // shorter input is not classified
+const double THRESHOLDVALUE = 1.03; // candidates within this factor of best
+const size_t MAXCANDIDATES = 5;  // more candidates means: unknown
 
-TextCat::TextCat( const std::string& cf ) {
-  TC = textcat_Init( cf.c_str() );
-  if ( TC == 0 ){
+TextCat::TextCat( const std::string& cf ): cfName( cf ) {
+  models = load_models( cf );
+  set_languages( vector<string>() );
+}
+
+shared_ptr<const TextCat::model_list> TextCat::load_models( const string& cf ){
+  // read the models listed in the configuration file cf. They are never
+  // changed, so every TextCat for the same file can use them.
+  static mutex models_lock;
+  static map<string,shared_ptr<const model_list>> models_cache;
+  lock_guard<mutex> guard( models_lock );
+  auto it = models_cache.find( cf );
+  if ( it != models_cache.end() ){
+    return it->second;
+  }
+  ifstream is( cf );
+  if ( !is ){
     throw runtime_error( "TextCat init failed: " + cf );
   }
-  cfName = cf;
+  shared_ptr<model_list> models = make_shared<model_list>();
+  string line;
+  while ( getline( is, line ) ){
+    line = TiCC::trim( line );
+    if ( line.empty() || line[0] == '#' ){
+      continue;
+    }
+    vector<string> parts;
+    if ( TiCC::split( line, parts ) != 2 ){
+      throw runtime_error( "TextCat init failed: " + cf
+			   + " invalid line: '" + line + "'" );
+    }
+    load_model( *models, parts[0], parts[1] );
+  }
+  if ( models->empty() ){
+    throw runtime_error( "TextCat init failed: " + cf
+			 + " no language models found" );
+  }
+  models_cache[cf] = models;
+  return models;
+}
 
+void TextCat::set_languages( const vector<string>& langs ){
+  // only score the languages in langs from now on. (empty means: all)
+  // unknown languages are silently ignored
+  active.clear();
+  for ( const auto& model : *models ){
+    if ( langs.empty()
+	 || find( langs.begin(), langs.end(), model.lang ) != langs.end() ){
+      active.push_back( &model );
+    }
+  }
 }
 
-TextCat::TextCat( const TextCat& in ) {
-  TC = textcat_Init( in.cfName.c_str() );
-  cfName = in.cfName;
+TextCat::~TextCat() {}
+
+UnicodeString decode_lm( const string& s ){
+  // the libexttextcat models are in UTF-8, the old libtextcat ones are
+  // just bytes, in practice Latin-1
+  UnicodeString result = TiCC::UnicodeFromUTF8( s );
+  if ( result.indexOf( (UChar32)0xFFFD ) >= 0 ){
+    result = UnicodeString( s.c_str(), s.size(), "ISO-8859-1" );
+  }
+  return result;
 }
 
-vector<string> TextCat::get_languages( const string& in ) const {
+void TextCat::load_model( model_list& models,
+			  const string& file, const string& lang ){
+  ifstream is( file );
+  if ( !is ){
+    throw runtime_error( "TextCat init failed: unable to open " + file );
+  }
+  lang_model model;
+  model.lang = lang;
+  string line;
+  int rank = 0;
+  while ( getline( is, line ) && (size_t)rank < MAXNGRAMS ){
+    // each line holds an n-gram, optionaly followed by it's count. The
+    // lines are sorted on frequency, so the line number is the rank
+    string::size_type pos = line.find_first_of( " \t\r" );
+    string ngram = line.substr( 0, pos );
+    if ( ngram.empty() ){
+      continue;
+    }
+    UnicodeString us = decode_lm( ngram );
+    if ( model.ranks.find( us ) == model.ranks.end() ){
+      model.ranks[us] = rank++;
+    }
+  }
+  models.push_back( model );
+}
+
+TextCat::fingerprint TextCat::make_fingerprint( const UnicodeString& in ) const {
+  // count all n-grams of 1 upto MAXNGRAMSIZE characters in the words of
+  // the input, marked with '_' around them. As in libtextcat, which built
+  // the models, words are only separated by spaces and digits, so
+  // punctuation is part of the n-grams
+  unordered_map<UnicodeString,int,ustring_hash> counts;
+  UnicodeString word;
+  for ( int32_t i = 0; i <= in.length(); ){
+    UChar32 c = ( i < in.length() ) ? in.char32At( i ) : (UChar32)' ';
+    i += ( i < in.length() ) ? U16_LENGTH( c ) : 1;
+    if ( !u_isspace( c ) && !( c >= '0' && c <= '9' ) ){
+      word += c;
+      continue;
+    }
+    if ( word.isEmpty() ){
+      continue;
+    }
+    UnicodeString w = "_";
+    w += word;
+    w += "_";
+    word.remove();
+    for ( int32_t j = 0; j < w.length(); j = w.moveIndex32( j, 1 ) ){
+      int32_t end = j;
+      for ( int n = 0; n < MAXNGRAMSIZE && end < w.length(); ++n ){
+	end = w.moveIndex32( end, 1 );
+	++counts[UnicodeString( w, j, end - j )];
+      }
+    }
+  }
+  vector<pair<UnicodeString,int>> sorted( counts.begin(), counts.end() );
+  sort( sorted.begin(), sorted.end(),
+	[]( const pair<UnicodeString,int>& a,
+	    const pair<UnicodeString,int>& b ){
+	  if ( a.second != b.second ){
+	    return a.second > b.second;
+	  }
+	  return a.first.compare( b.first ) < 0;
+	} );
+  fingerprint result;
+  for ( size_t r = 0; r < sorted.size() && r < MAXNGRAMS; ++r ){
+    result[sorted[r].first] = (int)r;
+  }
+  return result;
+}
+
+vector<lang_score> TextCat::score_all( const UnicodeString& in,
+				      bool exact ) const {
+  // score in against all active languages, best first.
+  // unless exact is true, the scoring of hopeless languages is cut short,
+  // so only the scores of the candidates are exact. The others are lower
+  // bounds.
+  vector<lang_score> result;
+  if ( in.countChar32() < MINDOCSIZE ){
+    return result;
+  }
+  fingerprint fp = make_fingerprint( in );
+  int best = -1;
+  for ( const auto model : active ){
+    int score = 0;
+    for ( const auto& it : fp ){
+      auto mit = model->ranks.find( it.first );
+      if ( mit == model->ranks.end() ){
+	score += (int)MAXNGRAMS;
+      }
+      else {
+	score += abs( mit->second - it.second );
+      }
+      if ( !exact && best >= 0 && score > best * THRESHOLDVALUE ){
+	// can't become a candidate anymore
+	break;
+      }
+    }
+    if ( best < 0 || score < best ){
+      best = score;
+    }
+    lang_score ls;
+    ls.lang = model->lang;
+    ls.score = score;
+    result.push_back( ls );
+  }
+  sort( result.begin(), result.end(),
+	[]( const lang_score& a, const lang_score& b ){
+	  return a.score < b.score; } );
+  return result;
+}
+
+vector<lang_score> TextCat::get_scores( const UnicodeString& in ) const {
+  // return the candidate languages for in, best first.
+  // An empty result means: too short or no idea.
+  vector<lang_score> result = score_all( in, false );
+  if ( result.empty() ){
+    return result;
+  }
+  int best = result[0].score;
+  size_t keep = 0;
+  while ( keep < result.size()
+	  && result[keep].score <= best * THRESHOLDVALUE ){
+    ++keep;
+  }
+  if ( keep > MAXCANDIDATES ){
+    result.clear();
+  }
+  else {
+    result.resize( keep );
+  }
+  return result;
+}
+
+string TextCat::get_language( const UnicodeString& in,
+			      double& confidence ) const {
+  // return the best scoring language, and in confidence the relative
+  // distance to the runner-up: 0 means a tie, 1 means no competition.
+  // returns "" (with confidence 0) when in is too short to decide.
+  // All languages are scored completely, so the runner-up is exact too.
+  confidence = 0.0;
+  vector<lang_score> scores = score_all( in, true );
+  if ( scores.empty() ){
+    return "";
+  }
+  if ( scores.size() == 1 ){
+    confidence = 1.0;
+  }
+  else if ( scores[1].score > 0 ){
+    confidence = double( scores[1].score - scores[0].score ) / scores[1].score;
+  }
+  return scores[0].lang;
+}
+
+vector<string> TextCat::get_languages( const UnicodeString& in ) const {
   vector<string> vals;
-  char *res = textcat_Classify( TC, in.c_str(), in.size() );
-  if ( res && strlen(res) > 0 && strcmp( res, "SHORT" ) != 0 ){
-    string val = res;
-    TiCC::split_at_first_of( val, vals, "[]" );
+  for ( const auto& ls : get_scores( in ) ){
+    vals.push_back( ls.lang );
   }
   return vals;
 }
 
-string TextCat::get_language( const string& in ) const {
-  vector<string> vals = get_languages( in );
+string TextCat::get_language( const UnicodeString& in ) const {
+  vector<lang_score> vals = get_scores( in );
   if ( vals.size() > 0 ){
-    return vals[0];
+    return vals[0].lang;
   }
   else {
     return "";
   }
 }
 
-#else
-TextCat::~TextCat() {}
+vector<string> TextCat::get_languages( const string& in ) const {
+  return get_languages( TiCC::UnicodeFromUTF8( in ) );
+}
 
-TextCat::TextCat( const std::string& cf ): TC(0) {
-  throw runtime_error( "TextCat::TextCat(" + cf + "): TextCat Support not available" );
+string TextCat::get_language( const string& in ) const {
+  return get_language( TiCC::UnicodeFromUTF8( in ) );
 }
 
-TextCat::TextCat( const TextCat& in ): TC(0) {
-  throw runtime_error( "TextCat::TextCat(): TextCat Support not available" );
+bool LangCache::lookup( const UnicodeString& key,
+			vector<string>& result ){
+  auto it = index.find( key );
+  if ( it == index.end() ){
+    ++misses;
+    return false;
+  }
+  ++hits;
+  lru.splice( lru.begin(), lru, it->second );
+  result = it->second->second;
+  return true;
 }
 
-vector<string> TextCat::get_languages( const string& in ) const {
-  throw runtime_error( "TextCat::get_languages(): TextCat Support not available" );
+void LangCache::store( const UnicodeString& key,
+		       const vector<string>& value ){
+  if ( max_size == 0 || index.find( key ) != index.end() ){
+    return;
+  }
+  lru.push_front( make_pair( key, value ) );
+  index[key] = lru.begin();
+  set_size( max_size );
 }
 
-string TextCat::get_language( const string& in ) const {
-  throw runtime_error( "TextCat::get_language(): TextCat Support not available" );
+void LangCache::clear(){
+  // drop all entries, e.g. when the set of languages changes
+  lru.clear();
+  index.clear();
 }
 
-#endif
+void LangCache::set_size( size_t s ){
+  // change the maximum number of entries, dropping the oldest if needed
+  max_size = s;
+  while ( lru.size() > max_size ){
+    index.erase( lru.back().first );
+    lru.pop_back();
+  }
+}
@@ -32,6 +32,10 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
 #include "config.h"
 #include "ticcutils/StringOps.h"
 #include "ticcutils/FileUtils.h"
@@ -193,13 +197,32 @@ namespace Tokenizer {
   }
 
   Rule::Rule( const UnicodeString& _id, const UnicodeString& _pattern):
-    id(_id), pattern(_pattern) {
-    regexp = new TiCC::UnicodeRegexMatcher( pattern, id );
+    id(_id), pattern(_pattern), time_limit(0), timed_out(false) {
+    UErrorCode err = U_ZERO_ERROR;
+    regexp = new RegexMatcher( pattern, 0, err );
+    if ( U_FAILURE( err ) ){
+      delete regexp;
+      regexp = 0;
+      throw uConfigError( "Invalid regular expression for rule " + id
+			  + ": " + pattern + " (" + u_errorName( err ) + ")",
+			  "" );
+    }
+  }
+
+  void Rule::setTimeLimit( int32_t limit ){
+    if ( limit == time_limit ){
+      return;
+    }
+    UErrorCode err = U_ZERO_ERROR;
+    regexp->setTimeLimit( limit, err );
+    if ( U_SUCCESS( err ) ){
+      time_limit = limit;
+    }
   }
 
   ostream& operator<< (std::ostream& os, const Rule& r ){
     if ( r.regexp ){
-      os << r.id << "=\"" << r.regexp->Pattern() << "\"";
+      os << r.id << "=\"" << r.pattern << "\"";
     }
     else
       os << r.id  << "=NULL";
@@ -210,34 +233,198 @@ namespace Tokenizer {
 		       UnicodeString& pre,
 		       UnicodeString& post,
 		       vector<UnicodeString>& matches ){
+    // find the first match of our pattern in line. matches gets the
+    // captured groups (or the whole match when there are none), pre and
+    // post the text before and after them. This splits up the match in
+    // the same way as TiCC::UnicodeRegexMatcher::match_all() does.
+    // A search that hits the time limit counts as no match
     matches.clear();
     pre = "";
     post = "";
+    timed_out = false;
 #ifdef MATCH_DEBUG
     cerr << "match: " << id << endl;
 #endif
-    if ( regexp && regexp->match_all( line, pre, post ) ){
-      int num = regexp->NumOfMatches();
-      if ( num >=1 ){
-	for( int i=1; i <= num; ++i ){
-	  matches.push_back( regexp->get_match( i ) );
-	}
+    if ( !regexp ){
+      return false;
+    }
+    UErrorCode err = U_ZERO_ERROR;
+    regexp->reset( line );
+    bool found = regexp->find( err );
+    if ( err == U_REGEX_TIME_OUT ){
+      timed_out = true;
+      return false;
+    }
+    if ( U_FAILURE( err ) || !found ){
+      return false;
+    }
+    const int groups = regexp->groupCount();
+    // every group that took part in the match. pre ends where the match
+    // starts, post starts after the last group, so text between the start
+    // of the match and its first group is dropped
+    int32_t end = 0;
+    for ( int i=0; i <= groups; ++i ){
+      err = U_ZERO_ERROR;
+      int32_t start = regexp->start( i, err );
+      if ( U_FAILURE( err ) ){
+	break;
       }
-      else {
-	matches.push_back( regexp->get_match( 0 ) );
+      if ( start < 0 ){
+	continue;
       }
-      return true;
+      if ( start > end ){
+	pre = UnicodeString( line, end, start );
+      }
+      end = regexp->end( i, err );
+      if ( U_FAILURE( err ) ){
+	break;
+      }
+      if ( i > 0 ){
+	matches.push_back( UnicodeString( line, start, end - start ) );
+      }
+    }
+    if ( matches.empty() ){
+      // only the match itself
+      err = U_ZERO_ERROR;
+      int32_t start = regexp->start( 0, err );
+      matches.push_back( UnicodeString( line, start,
+					regexp->end( 0, err ) - start ) );
+    }
+    if ( end < line.length() ){
+      post = UnicodeString( line, end );
+    }
+    return true;
+  }
+
+  RuleCache::~RuleCache(){
+    for ( const auto& it : rules ){
+      delete it.second;
     }
-    return false;
   }
 
-  Setting::~Setting(){
-    for ( const auto rule : rules ) {
+  Rule *RuleCache::get( const UnicodeString& id,
+			const UnicodeString& pattern ){
+    // return the compiled Rule for id and pattern. compile it when needed
+    auto key = make_pair( id, pattern );
+    {
+      lock_guard<mutex> guard( lock );
+      auto it = rules.find( key );
+      if ( it != rules.end() ){
+	return it->second;
+      }
+    }
+    // compile outside the lock, as Settings may be read in parallel.
+    Rule *rule = new Rule( id, pattern );
+    lock_guard<mutex> guard( lock );
+    auto it = rules.find( key );
+    if ( it != rules.end() ){
+      // somebody was faster
       delete rule;
+      return it->second;
+    }
+    rules[key] = rule;
+    return rule;
+  }
+
+  Setting::~Setting(){
+    if ( !rule_cache ){
+      for ( const auto rule : rules ) {
+	delete rule;
+      }
     }
     rulesmap.clear();
   }
 
+  Rule *Setting::new_rule( const UnicodeString& id,
+			   const UnicodeString& pattern ){
+    if ( rule_cache ){
+      return rule_cache->get( id, pattern );
+    }
+    return new Rule( id, pattern );
+  }
+
+  // The contents of the %include files, shared by all Settings in the
+  // process, as many languages include the same files. We only keep the
+  // trimmed lines which aren't empty or comment. An entry is only used
+  // while the file still has the same modification time and size, so a
+  // changed file is read again.
+  struct include_entry {
+    time_t mtime;
+    off_t size;
+    shared_ptr<const vector<UnicodeString>> lines;
+  };
+  mutex include_lock;
+  map<string,include_entry> include_cache;
+
+  shared_ptr<const vector<UnicodeString>> read_include( const string& fname ){
+    struct stat st;
+    if ( stat( fname.c_str(), &st ) != 0 ){
+      return 0;
+    }
+    lock_guard<mutex> guard( include_lock );
+    auto it = include_cache.find( fname );
+    if ( it != include_cache.end()
+	 && it->second.mtime == st.st_mtime
+	 && it->second.size == st.st_size ){
+      return it->second.lines;
+    }
+    ifstream f( fname );
+    if ( !f ){
+      return 0;
+    }
+    shared_ptr<vector<UnicodeString>> lines = make_shared<vector<UnicodeString>>();
+    string rawline;
+    while ( getline( f, rawline ) ){
+      UnicodeString line = TiCC::UnicodeFromUTF8(rawline);
+      line.trim();
+      if ((line.length() > 0) && (line[0] != '#')) {
+	lines->push_back( line );
+      }
+    }
+    include_entry entry;
+    entry.mtime = st.st_mtime;
+    entry.size = st.st_size;
+    entry.lines = lines;
+    include_cache[fname] = entry;
+    return lines;
+  }
+
+  void Setting::setTimeLimit( int32_t limit ){
+    time_limit = limit;
+    for ( const auto rule : rules ){
+      rule->setTimeLimit( limit );
+    }
+  }
+
+  Setting *Setting::clone() const {
+    // make a copy with fresh Rules, so it can be used independently
+    // (e.g. in another thread) The files are NOT read again.
+    Setting *result = new Setting();
+    if ( pending ){
+      // nothing read yet. the copy will be compiled on its own
+      result->set_file = set_file;
+      result->add_file = add_file;
+      result->pending = true;
+      result->compile_error = compile_error;
+      result->tokDebug = tokDebug;
+      result->theErrLog = theErrLog;
+      return result;
+    }
+    for ( const auto rule : rules ){
+      result->rules.push_back( new Rule( rule->id, rule->pattern ) );
+    }
+    result->rules_index = rules_index;
+    result->eosmarkers = eosmarkers;
+    result->quotes = quotes;
+    result->quotes.clearStack();
+    result->filter = filter;
+    result->set_file = set_file;
+    result->version = version;
+    result->tokDebug = tokDebug;
+    result->theErrLog = theErrLog;
+    return result;
+  }
+
   set<string> Setting::installed_languages() {
     // we only return 'languages' which are installed as 'tokconfig-*'
     //
@@ -258,29 +445,22 @@ namespace Tokenizer {
     if ( tokDebug > 0 ){
       LOG << "%include " << fname << endl;
     }
-    ifstream f( fname );
-    if ( !f ){
+    auto lines = read_include( fname );
+    if ( !lines ){
       return false;
     }
-    else {
-      string rawline;
-      while ( getline( f, rawline ) ){
-	UnicodeString line = TiCC::UnicodeFromUTF8(rawline);
-	line.trim();
-	if ((line.length() > 0) && (line[0] != '#')) {
-	  if ( tokDebug >= 5 ){
-	    LOG << "include line = " << rawline << endl;
-	  }
-	  const int splitpoint = line.indexOf("=");
-	  if ( splitpoint < 0 ){
-	    throw uConfigError( "invalid RULES entry: " + line,
-				fname );
-	  }
-	  UnicodeString id = UnicodeString( line, 0,splitpoint);
-	  UnicodeString pattern = UnicodeString( line, splitpoint+1);
-	  rulesmap[id] = new Rule( id, pattern);
-	}
+    for ( const auto& line : *lines ){
+      if ( tokDebug >= 5 ){
+	LOG << "include line = " << line << endl;
+      }
+      const int splitpoint = line.indexOf("=");
+      if ( splitpoint < 0 ){
+	throw uConfigError( "invalid RULES entry: " + line,
+			    fname );
       }
+      UnicodeString id = UnicodeString( line, 0,splitpoint);
+      UnicodeString pattern = UnicodeString( line, splitpoint+1);
+      rulesmap[id] = new_rule( id, pattern );
     }
     return true;
   }
@@ -296,38 +476,31 @@ namespace Tokenizer {
     if ( tokDebug > 0 ){
       LOG << "%include " << fname << endl;
     }
-    ifstream f( fname );
-    if ( !f ){
+    auto lines = read_include( fname );
+    if ( !lines ){
       return false;
     }
-    else {
-      string rawline;
-      while ( getline( f, rawline ) ){
-	UnicodeString line = TiCC::UnicodeFromUTF8(rawline);
-	line.trim();
-	if ((line.length() > 0) && (line[0] != '#')) {
-	  if ( tokDebug >= 5 ){
-	    LOG << "include line = " << rawline << endl;
-	  }
-	  int splitpoint = line.indexOf(" ");
-	  if ( splitpoint == -1 )
-	    splitpoint = line.indexOf("\t");
-	  if ( splitpoint == -1 ){
-	    throw uConfigError( "invalid QUOTES entry: " + line
-				+ " (missing whitespace)",
-				fname );
-	  }
-	  UnicodeString open = UnicodeString( line, 0,splitpoint);
-	  UnicodeString close = UnicodeString( line, splitpoint+1);
-	  open = open.trim().unescape();
-	  close = close.trim().unescape();
-	  if ( open.isEmpty() || close.isEmpty() ){
-	    throw uConfigError( "invalid QUOTES entry: " + line, fname );
-	  }
-	  else {
-	    quotes.add( open, close );
-	  }
-	}
+    for ( const auto& line : *lines ){
+      if ( tokDebug >= 5 ){
+	LOG << "include line = " << line << endl;
+      }
+      int splitpoint = line.indexOf(" ");
+      if ( splitpoint == -1 )
+	splitpoint = line.indexOf("\t");
+      if ( splitpoint == -1 ){
+	throw uConfigError( "invalid QUOTES entry: " + line
+			    + " (missing whitespace)",
+			    fname );
+      }
+      UnicodeString open = UnicodeString( line, 0,splitpoint);
+      UnicodeString close = UnicodeString( line, splitpoint+1);
+      open = open.trim().unescape();
+      close = close.trim().unescape();
+      if ( open.isEmpty() || close.isEmpty() ){
+	throw uConfigError( "invalid QUOTES entry: " + line, fname );
+      }
+      else {
+	quotes.add( open, close );
       }
     }
     return true;
@@ -337,28 +510,21 @@ namespace Tokenizer {
     if ( tokDebug > 0 ){
       LOG << "%include " << fname << endl;
     }
-    ifstream f( fname );
-    if ( !f ){
+    auto lines = read_include( fname );
+    if ( !lines ){
       return false;
     }
-    else {
-      string rawline;
-      while ( getline( f, rawline ) ){
-	UnicodeString line = TiCC::UnicodeFromUTF8(rawline);
-	line.trim();
-	if ((line.length() > 0) && (line[0] != '#')) {
-	  if ( tokDebug >= 5 ){
-	    LOG << "include line = " << rawline << endl;
-	  }
-	  if ( ( line.startsWith("\\u") && line.length() == 6 ) ||
-	       ( line.startsWith("\\U") && line.length() == 10 ) ){
-	    UnicodeString uit = line.unescape();
-	    if ( uit.isEmpty() ){
-	      throw uConfigError( "Invalid EOSMARKERS entry: " + line, fname );
-	    }
-	    eosmarkers += uit;
-	  }
+    for ( const auto& line : *lines ){
+      if ( tokDebug >= 5 ){
+	LOG << "include line = " << line << endl;
+      }
+      if ( ( line.startsWith("\\u") && line.length() == 6 ) ||
+	   ( line.startsWith("\\U") && line.length() == 10 ) ){
+	UnicodeString uit = line.unescape();
+	if ( uit.isEmpty() ){
+	  throw uConfigError( "Invalid EOSMARKERS entry: " + line, fname );
 	}
+	eosmarkers += uit;
       }
     }
     return true;
@@ -399,26 +565,18 @@ namespace Tokenizer {
     if ( tokDebug > 0 ){
       LOG << "%include " << fname << endl;
     }
-    ifstream f( fname );
-    if ( !f ){
+    auto lines = read_include( fname );
+    if ( !lines ){
       return false;
     }
-    else {
-      string rawline;
-      while ( getline( f, rawline ) ){
-	UnicodeString line = TiCC::UnicodeFromUTF8(rawline);
-	line.trim();
-	if ((line.length() > 0) && (line[0] != '#')) {
-	  if ( tokDebug >= 5 ){
-	    LOG << "include line = " << rawline << endl;
-	  }
-	  line = escape_regex( line );
-	  if ( !abbreviations.isEmpty()){
-	    abbreviations += '|';
-	  }
-	  abbreviations += line;
-	}
+    for ( const auto& line : *lines ){
+      if ( tokDebug >= 5 ){
+	LOG << "include line = " << line << endl;
       }
+      if ( !abbreviations.isEmpty()){
+	abbreviations += '|';
+      }
+      abbreviations += escape_regex( line );
     }
     return true;
   }
@@ -429,7 +587,7 @@ namespace Tokenizer {
     for ( auto const& part : parts ){
       pat += part;
     }
-    rulesmap[name] = new Rule( name, pat );
+    rulesmap[name] = new_rule( name, pat );
   }
 
   void Setting::sortRules( map<UnicodeString, Rule *>& rulesmap,
@@ -549,9 +707,37 @@ namespace Tokenizer {
     }
   }
 
+  void Setting::compile(){
+    // do the work a lazy read() deferred
+    // When that fails, this Setting is unusable, and every next call
+    // throws the same error again
+    if ( !pending ){
+      return;
+    }
+    if ( compile_error ){
+      rethrow_exception( compile_error );
+    }
+    if ( tokDebug ){
+      LOG << "compiling deferred settings: " << set_file << endl;
+    }
+    try {
+      if ( !read( set_file, add_file, tokDebug, theErrLog ) ){
+	throw uConfigError( string("deferred reading failed"), set_file );
+      }
+    }
+    catch ( ... ){
+      compile_error = current_exception();
+      throw;
+    }
+    pending = false;
+  }
+
   bool Setting::read( const string& settings_name,
 		      const string& add_tokens,
-		      int dbg, TiCC::LogStream* ls ) {
+		      int dbg, TiCC::LogStream* ls,
+		      bool lazy ) {
+    // when lazy is true, only check the files, and postpone reading and
+    // compiling them until compile() is called.
     tokDebug = dbg;
     theErrLog = ls;
     map<ConfigMode, UnicodeString> pattern = { { ABBREVIATIONS, "" },
@@ -574,6 +760,12 @@ namespace Tokenizer {
       LOG << "Unable to open additional tokens file: " << add_tokens << endl;
       return false;
     }
+    if ( lazy ){
+      set_file = settings_name;
+      add_file = add_tokens;
+      pending = true;
+      return true;
+    }
     ifstream f( conffile );
     if ( f ){
       ConfigMode mode = NONE;
@@ -653,7 +845,7 @@ namespace Tokenizer {
 	      }
 	      UnicodeString id = UnicodeString( line, 0,splitpoint);
 	      UnicodeString pattern = UnicodeString( line, splitpoint+1);
-	      rulesmap[id] = new Rule( id, pattern);
+	      rulesmap[id] = new_rule( id, pattern );
 	    }
 	      break;
 	    case RULEORDER:
@@ -31,13 +31,22 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <exception>
+#include <chrono>
 #include "config.h"
 #include "unicode/schriter.h"
 #include "unicode/ucnv.h"
+#include "unicode/normalizer2.h"
 #include "ticcutils/StringOps.h"
 #include "ticcutils/PrettyPrint.h"
 #include "ticcutils/Unicode.h"
 #include "ucto/my_textcat.h"
+#ifdef HAVE_FOLIA_ENGINE
+#include "libfolia/folia_engine.h"
+#endif
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
 
 #define DO_READLINE
 #ifdef HAVE_LIBREADLINE
@@ -118,6 +127,9 @@ namespace Tokenizer {
   const UnicodeString type_punctuation = "PUNCTUATION";
   const UnicodeString type_number = "NUMBER";
   const UnicodeString type_unknown = "UNKNOWN";
+  const UnicodeString type_longword = "LONGWORD";
+
+  const int max_word_length = 2500; // characters. see setLongWordPolicy()
 
   Token::Token( const UnicodeString& _type,
 		const UnicodeString& _s,
@@ -135,6 +147,61 @@ namespace Tokenizer {
     return os;
   }
 
+  TokenizerStats& TokenizerStats::operator+=( const TokenizerStats& s ){
+    lines += s.lines;
+    tokens += s.tokens;
+    sentences += s.sentences;
+    buffered_tokens += s.buffered_tokens;
+    quote_depth += s.quote_depth;
+    long_words += s.long_words;
+    invalid_lines += s.invalid_lines;
+    rule_timeouts += s.rule_timeouts;
+    fallback_lines += s.fallback_lines;
+    fallback_tokens += s.fallback_tokens;
+    normalize_sec += s.normalize_sec;
+    filter_sec += s.filter_sec;
+    tokenize_sec += s.tokenize_sec;
+    sentence_sec += s.sentence_sec;
+    output_sec += s.output_sec;
+    return *this;
+  }
+
+  ostream& operator<<( ostream& os, const TokenizerStats& s ){
+    os << "lines=" << s.lines << " tokens=" << s.tokens
+       << " sentences=" << s.sentences
+       << " buffered=" << s.buffered_tokens
+       << " quote_depth=" << s.quote_depth
+       << " long_words=" << s.long_words
+       << " invalid_lines=" << s.invalid_lines
+       << " rule_timeouts=" << s.rule_timeouts
+       << " fallback_lines=" << s.fallback_lines
+       << " fallback_tokens=" << s.fallback_tokens
+       << " normalize=" << s.normalize_sec << "s"
+       << " filter=" << s.filter_sec << "s"
+       << " tokenize=" << s.tokenize_sec << "s"
+       << " sentence=" << s.sentence_sec << "s"
+       << " output=" << s.output_sec << "s";
+    return os;
+  }
+
+  class phase_timer {
+    // adds the lifetime of this object (or until stop()) to a phase time
+  public:
+    explicit phase_timer( double& s ):
+      sum(&s), start( chrono::steady_clock::now() ) {};
+    ~phase_timer() { stop(); };
+    void stop() {
+      if ( sum ){
+	*sum += chrono::duration<double>( chrono::steady_clock::now()
+					  - start ).count();
+	sum = 0;
+      }
+    };
+  private:
+    double *sum;
+    chrono::steady_clock::time_point start;
+  };
+
   ostream& operator<<( ostream& os, const TokenRole& tok ){
     if ( tok & NOSPACE) os << "NOSPACE ";
     if ( tok & BEGINOFSENTENCE) os << "BEGINOFSENTENCE ";
@@ -142,6 +209,7 @@ namespace Tokenizer {
     if ( tok & NEWPARAGRAPH) os << "NEWPARAGRAPH ";
     if ( tok & BEGINQUOTE) os << "BEGINQUOTE ";
     if ( tok & ENDQUOTE) os << "ENDQUOTE ";
+    if ( tok & FALLBACK) os << "FALLBACK ";
     return os;
   }
 
@@ -158,6 +226,12 @@ namespace Tokenizer {
     detectPar(true),
     paragraphsignal(true),
     doDetectLang(false),
+    detect_unit("line"),
+    detect_chars(0),
+    sticky_lang(false),
+    unit_size(0),
+    lang_confident(false),
+    unchecked_size(0),
     text_redundancy("minimal"),
     sentenceperlineoutput(false),
     sentenceperlineinput(false),
@@ -166,16 +240,27 @@ namespace Tokenizer {
     xmlout(false),
     xmlin(false),
     passthru(false),
+    streaming(false),
+    lazy_settings(false),
+    profile_rules(false),
+    rule_time_limit(0),
+    line_budget(-1.0),
+    long_word_policy("line"),
+    line_chunk_size(0),
+    line_continued(false),
+    slow_threshold(0.0),
+    word_depth(0),
+    numThreads(1),
+    declared_doc(0),
     inputclass("current"),
     outputclass("current"),
-    tc( 0 )
+    tc( 0 ),
+    lang_cache( 0 ),
+    lang_cache_size( 10000 ),
+    rule_cache( new RuleCache() )
   {
     theErrLog = new TiCC::LogStream(cerr, "ucto" );
     theErrLog->setstamp( StampMessage );
-#ifdef HAVE_TEXTCAT
-    string textcat_cfg = string(SYSCONF_PATH) + "/ucto/textcat.cfg";
-    tc = new TextCat( textcat_cfg );
-#endif
   }
 
   TokenizerClass::~TokenizerClass(){
@@ -192,12 +277,15 @@ namespace Tokenizer {
       }
 
     }
+    delete rule_cache; // after the settings that use it
     delete theErrLog;
     delete tc;
+    delete lang_cache;
   }
 
   bool TokenizerClass::reset( const string& lang ){
     tokens.clear();
+    line_continued = false;
     settings[lang]->quotes.clearStack();
     return true;
   }
@@ -235,6 +323,201 @@ namespace Tokenizer {
     }
   }
 
+  string TokenizerClass::setLangDetectUnit( const std::string& unit ){
+    string s = detect_unit;
+    if ( unit == "line" || unit == "paragraph" || unit == "document" ){
+      detect_chars = 0;
+    }
+    else if ( !TiCC::stringTo( unit, detect_chars ) || detect_chars == 0 ){
+      throw runtime_error( "illegal value '" + unit + "' for language "
+			   "detection unit. expected 'line', 'paragraph', "
+			   "'document' or a number of characters." );
+    }
+    detect_unit = unit;
+    resetLangDetection( true );
+    return s;
+  }
+
+  string TokenizerClass::setLongWordPolicy( const std::string& policy ){
+    if ( policy != "line" && policy != "skip" && policy != "chunk" ){
+      throw runtime_error( "illegal value '" + policy + "' for the long word "
+			   "policy. expected 'line', 'skip' or 'chunk'." );
+    }
+    string s = long_word_policy;
+    long_word_policy = policy;
+    return s;
+  }
+
+  void TokenizerClass::resetLangDetection( bool all ){
+    // start a new detection unit. When all is true, also forget the
+    // language of the previous one
+    if ( !detected_lang.empty() ){
+      last_lang = detected_lang;
+    }
+    detected_lang.clear();
+    detect_text.remove();
+    unit_size = 0;
+    if ( all ){
+      last_lang.clear();
+      lang_confident = false;
+      unchecked_size = 0;
+    }
+  }
+
+  void TokenizerClass::setLangCacheSize( size_t s ){
+    lang_cache_size = s;
+    if ( lang_cache ){
+      lang_cache->set_size( s );
+    }
+  }
+
+  bool TokenizerClass::getLangCacheStats( size_t& hits,
+					  size_t& misses ) const {
+    if ( !lang_cache ){
+      hits = misses = 0;
+      return false;
+    }
+    hits = lang_cache->get_hits();
+    misses = lang_cache->get_misses();
+    return true;
+  }
+
+  TextCat *TokenizerClass::get_textcat() const {
+    // loading the language models is expensive, so we wait until we
+    // really have to guess a language. returns 0 when we can't
+#ifdef HAVE_TEXTCAT
+    if ( !tc ){
+      string textcat_cfg = string(SYSCONF_PATH) + "/ucto/textcat.cfg";
+      tc = new TextCat( textcat_cfg );
+      tc->set_languages( tc_languages );
+      lang_cache = new LangCache( lang_cache_size );
+    }
+#endif
+    return tc;
+  }
+
+  // longer texts are hardly ever repeated, so we don't cache them
+  const int32_t max_cached_text = 256;
+
+  vector<string> TokenizerClass::guess_languages( const UnicodeString& text ) const {
+    // ask TextCat for the candidate languages of text, best first.
+    // Short texts are looked up in (and added to) the cache first.
+    vector<string> result;
+    if ( !get_textcat() ){
+      return result;
+    }
+    UnicodeString temp = text;
+    temp.toLower();
+    const bool cacheable = lang_cache
+      && lang_cache->get_size() > 0
+      && temp.length() <= max_cached_text;
+    if ( cacheable && lang_cache->lookup( temp, result ) ){
+      return result;
+    }
+    result = tc->get_languages( temp );
+    if ( cacheable ){
+      lang_cache->store( temp, result );
+    }
+    return result;
+  }
+
+  // below this confidence TextCat's best guess is hardly better than the
+  // runner-up. (see TextCat::get_language())
+  const double min_lang_confidence = 0.05;
+
+  string TokenizerClass::classify_language( const UnicodeString& text,
+					    double& confidence ) const {
+    // ask TextCat. returns a supported language or "default"
+    // confidence is only computed in sticky mode, otherwise it is 0
+    string lan;
+    confidence = 0.0;
+    if ( sticky_lang ){
+      // when TextCat isn't sure, stay with the previous language
+      if ( get_textcat() ){
+	UnicodeString temp = text;
+	temp.toLower();
+	lan = tc->get_language( temp, confidence );
+      }
+      if ( !last_lang.empty() && confidence < min_lang_confidence ){
+	if ( tokDebug > 3 ){
+	  LOG << "sticking to language: " << last_lang << " (confidence "
+	      << confidence << ")" << endl;
+	}
+	return last_lang;
+      }
+    }
+    else {
+      vector<string> candidates = guess_languages( text );
+      if ( !candidates.empty() ){
+	lan = candidates[0];
+      }
+    }
+    if ( settings.find( lan ) != settings.end() ){
+      if ( tokDebug > 3 ){
+	LOG << "found a supported language: " << lan << endl;
+      }
+    }
+    else {
+      if ( tokDebug > 3 ){
+	LOG << "found an unsupported language: " << lan << endl;
+      }
+      lan = "default";
+    }
+    return lan;
+  }
+
+  // when this much text of a unit is seen, we stop refining the guess.
+  // the lines before that get the guess for the text so far
+  const size_t detect_window = 256;
+
+  // in sticky mode, a confident guess is kept for this many characters
+  // before TextCat is asked again
+  const size_t sticky_recheck = 5000;
+
+  string TokenizerClass::detect_language( const UnicodeString& line ){
+    // guess the language of the next line of text input
+    if ( sticky_lang && lang_confident && !last_lang.empty()
+	 && unchecked_size < sticky_recheck ){
+      unchecked_size += line.length();
+      if ( tokDebug > 3 ){
+	LOG << "sticky language " << last_lang << ", no need to guess" << endl;
+      }
+      return last_lang;
+    }
+    if ( tokDebug > 3 ){
+      LOG << "use textCat to guess language from: " << line << endl;
+    }
+    double confidence = 0.0;
+    if ( detect_unit == "line" ){
+      string lan = classify_language( line, confidence );
+      last_lang = lan;
+      lang_confident = ( confidence >= min_lang_confidence );
+      unchecked_size = 0;
+      return lan;
+    }
+    size_t window = detect_window;
+    if ( detect_chars > 0 && detect_chars < window ){
+      window = detect_chars;
+    }
+    if ( detected_lang.empty()
+	 || (size_t)detect_text.length() < window ){
+      // not enough evidence yet. Add this line and try again
+      if ( !detect_text.isEmpty() ){
+	detect_text += " ";
+      }
+      detect_text += line;
+      detected_lang = classify_language( detect_text, confidence );
+      lang_confident = ( confidence >= min_lang_confidence );
+      unchecked_size = 0;
+    }
+    string result = detected_lang;
+    unit_size += line.length();
+    if ( detect_chars > 0 && unit_size >= detect_chars ){
+      resetLangDetection();
+    }
+    return result;
+  }
+
   void stripCR( string& s ){
     string::size_type pos = s.rfind( '\r' );
     if ( pos != string::npos ){
@@ -242,6 +525,67 @@ namespace Tokenizer {
     }
   }
 
+  bool byte_encoding( const string& encoding ){
+    // true for UTF-8 and single byte encodings, where read_line() may cut
+    // a line in pieces. The name is normalized by ICU, so "utf8",
+    // "UTF-8" and "ISO-8859-1", "latin1" etc. are all found
+    UErrorCode err = U_ZERO_ERROR;
+    UConverter *conv = ucnv_open( encoding.c_str(), &err );
+    if ( U_FAILURE( err ) ){
+      return false;
+    }
+    bool result = ( ucnv_getType( conv ) == UCNV_UTF8
+		    || ucnv_getMaxCharSize( conv ) == 1 );
+    ucnv_close( conv );
+    return result;
+  }
+
+  bool read_line( istream& is, string& line, size_t chunk_size,
+		  bool& complete ){
+    // like getline(), but when chunk_size > 0, return an over-long line in
+    // pieces of about chunk_size bytes. A piece is cut after a space or
+    // tab when there is one, otherwise (at 2 * chunk_size) before the next
+    // UTF-8 character. complete is false when more of the line follows
+    complete = true;
+    if ( chunk_size == 0 ){
+      return bool( getline( is, line ) );
+    }
+    line.clear();
+    istream::sentry se( is, true );
+    if ( !se ){
+      return false;
+    }
+    streambuf *sb = is.rdbuf();
+    while ( true ){
+      int c = sb->sbumpc();
+      if ( c == EOF ){
+	if ( line.empty() ){
+	  is.setstate( ios::eofbit | ios::failbit );
+	  return false;
+	}
+	is.setstate( ios::eofbit );
+	return true;
+      }
+      if ( c == '\n' ){
+	return true;
+      }
+      line += char(c);
+      if ( line.size() >= chunk_size ){
+	if ( c == ' ' || c == '\t' ){
+	  complete = false;
+	  return true;
+	}
+	if ( line.size() >= 2 * chunk_size ){
+	  int next = sb->sgetc();
+	  if ( next != EOF && next != '\n' && ( next & 0xC0 ) != 0x80 ){
+	    complete = false;
+	    return true;
+	  }
+	}
+      }
+    }
+  }
+
   void TokenizerClass::extractSentencesAndFlush( int numS,
 						 vector<Token>& outputTokens,
 						 const string& lang ){
@@ -274,6 +618,7 @@ namespace Tokenizer {
 	for ( size_t i=begin; i < end; ++i ){
 	  outputTokens.push_back( tokens[i] );
 	}
+	++stats.sentences;
 	if ( ++count == numS ){
 	  if (tokDebug >= 1){
 	    LOG << "[tokenize] erase " << end  << " tokens from " << tokens.size() << endl;
@@ -304,16 +649,29 @@ namespace Tokenizer {
     vector<Token> outputTokens;
     bool done = false;
     bool bos = true;
+    // UTF-16, UTF-32 and other multibyte input can't be cut at any byte
+    const size_t chunk_size = ( line_chunk_size > 0
+				&& byte_encoding( inputEncoding ) )
+      ? line_chunk_size : 0;
     do {
       string line;
-      done = !getline( IN, line );
-      ++linenum;
+      bool complete = true;
+      done = !read_line( IN, line, chunk_size, complete );
+      const bool continued = line_continued;
+      line_continued = !done && !complete;
+      if ( !continued ){
+	++linenum;
+	++stats.lines;
+      }
       if ( tokDebug > 0 ){
 	LOG << "[tokenize] Read input line # " << linenum
+	    << ( continued ? " (continued)" : "" )
 			<< "\nline:'" << TiCC::format_nonascii( line )
 			<< "'" << endl;
       }
-      stripCR( line );
+      if ( complete ){
+	stripCR( line );
+      }
       UnicodeString input_line;
       if ( line.size() > 0 && line[0] == 0 ){
 	// when processing UTF16LE, '0' bytes show up at pos 0
@@ -335,7 +693,7 @@ namespace Tokenizer {
 	  LOG << "voor strip:'" << TiCC::format_nonascii( line ) << "'" << endl;
 	}
 	input_line = convert( line, inputEncoding );
-	if ( sentenceperlineinput ){
+	if ( sentenceperlineinput && complete ){
 	  input_line += " " + eosmark;
 	}
       }
@@ -346,39 +704,35 @@ namespace Tokenizer {
       }
       int numS;
       if ( done
-	   || input_line.isEmpty() ){
+	   || ( input_line.isEmpty() && !continued ) ){
 	signalParagraph();
+	if ( detect_unit == "paragraph" ){
+	  resetLangDetection();
+	}
 	numS = countSentences(true); //count full sentences in token buffer, force buffer to empty!
       }
       else {
-	if ( passthru ){
+	// a piece of a long line is tokenized as a line of its own. When
+	// it was cut inside a word, its last token isn't followed by a space
+	const size_t begin_size = tokens.size();
+	if ( input_line.isEmpty() ){
+	  // the (empty) end of a line that was cut after a space
+	}
+	else if ( passthru ){
 	  passthruLine( input_line, bos );
 	}
 	else {
 	  string language = "default";
-	  if ( tc ){
-	    if ( tokDebug > 3 ){
-	      LOG << "use textCat to guess language from: "
-		  << input_line << endl;
-	    }
-	    UnicodeString temp = input_line;
-	    temp.toLower();
-	    string lan = tc->get_language( TiCC::UnicodeToUTF8(temp) );
-	    if ( settings.find( lan ) != settings.end() ){
-	      if ( tokDebug > 3 ){
-		LOG << "found a supported language: " << lan << endl;
-	      }
-	    }
-	    else {
-	      if ( tokDebug > 3 ){
-		LOG << "found an unsupported language: " << lan << endl;
-	      }
-	      lan = "default";
-	    }
-	    language = lan;
+	  if ( doDetectLang || settings.size() > 2 ){
+	    language = detect_language( input_line );
 	  }
 	  tokenizeLine( input_line, language, "" );
 	}
+	if ( line_continued
+	     && line.back() != ' ' && line.back() != '\t'
+	     && tokens.size() > begin_size ){
+	  tokens.back().role |= NOSPACE;
+	}
 	numS = countSentences(); //count full sentences in token buffer
       }
       if ( numS > 0 ) { //process sentences
@@ -421,6 +775,7 @@ namespace Tokenizer {
     do {
       done = !getline( IN, line );
       linenum++;
+      ++stats.lines;
       if (tokDebug > 0) {
 	LOG << "[tokenize] Read input line " << linenum << endl;
       }
@@ -464,6 +819,7 @@ namespace Tokenizer {
 
   folia::Document *TokenizerClass::tokenize( istream& IN ) {
     inputEncoding = checkBOM( IN );
+    resetLangDetection( true );
     folia::Document *doc = new folia::Document( "id='" + docid + "'" );
     if ( /*doDetectLang &&*/ default_language != "none" ){
       if ( tokDebug > 0 ){
@@ -521,6 +877,9 @@ namespace Tokenizer {
       }
       this->tokenize( *IN, *OUT );
     }
+    else if ( streaming ){
+      tokenizeStreaming( ifile, *OUT );
+    }
     else {
       folia::Document doc;
       doc.readFromFile(ifile);
@@ -581,6 +940,7 @@ namespace Tokenizer {
     else {
       int i = 0;
       inputEncoding = checkBOM( IN );
+      resetLangDetection( true );
       do {
 	if ( tokDebug > 0 ){
 	  LOG << "[tokenize] looping on stream" << endl;
@@ -598,11 +958,25 @@ namespace Tokenizer {
     }
   }
 
-  bool TokenizerClass::tokenize( folia::Document& doc ) {
-    xmlin = true; // tautology
-    if ( tokDebug >= 2 ){
-      LOG << "tokenize doc " << doc << endl;
+  void TokenizerClass::declareOnce( folia::Document *doc,
+				    folia::AnnotationType::AnnotationType type,
+				    const string& setname,
+				    const string& args ) const {
+    // declaring the same set over and over again, for every element, is
+    // expensive. Remember what is declared already in this document
+    if ( doc != declared_doc ){
+      declared_doc = doc;
+      declared.clear();
     }
+    if ( declared.insert( make_pair( int(type), setname ) ).second ){
+      doc->declare( type, setname, args );
+    }
+  }
+
+  void TokenizerClass::tokenizeDoc_init( folia::Document& doc ) {
+    // a new document, which might live on the address of a deleted one
+    declared_doc = &doc;
+    declared.clear();
     if ( inputclass == outputclass ){
       LOG << "ucto: --filter=NO is automatically set. inputclass equals outputclass!"
 	  << endl;
@@ -628,6 +1002,18 @@ namespace Tokenizer {
 	}
       }
     }
+  }
+
+  bool TokenizerClass::tokenize( folia::Document& doc ) {
+    xmlin = true; // tautology
+    if ( tokDebug >= 2 ){
+      LOG << "tokenize doc " << doc << endl;
+    }
+    tokenizeDoc_init( doc );
+    if ( numThreads > 1 ){
+      tokenizeParallel( doc );
+      return true;
+    }
     for ( size_t i = 0; i < doc.doc()->size(); i++) {
       if (tokDebug >= 2) {
 	LOG << "[tokenize] Invoking processing of first-level element " << doc.doc()->index(i)->id() << endl;
@@ -637,6 +1023,70 @@ namespace Tokenizer {
     return true;
   }
 
+#ifdef HAVE_FOLIA_ENGINE
+  // in streaming mode, finished elements are written out and freed after
+  // this many text-bearing elements. Flushing after every element costs
+  // a lot of small writes, waiting longer costs memory
+  const int stream_flush_interval = 100;
+
+  void TokenizerClass::tokenizeStreaming( const string& ifile,
+					  ostream& OUT ){
+    // process a FoLiA document element by element, using the libfolia
+    // TextEngine. Only the text-bearing element at hand and its ancestors
+    // are kept in memory. Finished parts are written to OUT and discarded.
+    xmlin = true;
+    folia::TextEngine proc;
+    if ( tokDebug > 8 ){
+      proc.set_dbg_stream( theErrLog );
+      proc.set_debug( true );
+    }
+    if ( !proc.init_doc( ifile, &OUT ) ){
+      throw runtime_error( "unable to find or read file: '" + ifile + "'" );
+    }
+    proc.setup( inputclass, true );
+    folia::Document *doc = proc.doc();
+    tokenizeDoc_init( *doc );
+    // the header is written before any element is tokenized, so all
+    // declarations we might need, must be made now.
+    if ( passthru ){
+      declareOnce( doc, folia::AnnotationType::TOKEN, "passthru",
+		   "annotator='ucto', annotatortype='auto', datetime='now()'" );
+    }
+    else {
+      for ( const auto& s : settings ){
+	declareOnce( doc, folia::AnnotationType::TOKEN, s.second->set_file,
+		     "annotator='ucto', annotatortype='auto', datetime='now()'");
+      }
+    }
+    if ( doDetectLang || settings.size() > 2 ){
+      declareOnce( doc, folia::AnnotationType::LANG,
+		   ISO_SET, "annotator='ucto'" );
+    }
+    proc.output_header();
+    int done = 0;
+    folia::FoliaElement *p = 0;
+    while ( ( p = proc.next_text_parent() ) ){
+      if ( tokDebug >= 2 ){
+	LOG << "[tokenizeStreaming] next text parent: " << p->id() << endl;
+      }
+      tokenizeElement( p );
+      if ( ++done >= stream_flush_interval ){
+	// write out what is finished, and free it
+	proc.flush();
+	done = 0;
+      }
+    }
+    proc.output_footer();
+  }
+#else
+  void TokenizerClass::tokenizeStreaming( const string& ifile,
+					  ostream& ){
+    throw runtime_error( "TokenizerClass::tokenizeStreaming(" + ifile
+			 + "): streaming FoLiA support not available. "
+			 + "(libfolia >= 2.0 is needed)" );
+  }
+#endif
+
   void appendText( folia::FoliaElement *root,
 		   const string& outputclass  ){
     // set the textcontent of root to that of it's children
@@ -653,6 +1103,40 @@ namespace Tokenizer {
     root->settext( TiCC::UnicodeToUTF8(utxt), outputclass );
   }
 
+  struct text_builder {
+    // collects the text of an element from the words (and sentences etc.)
+    // we add to it. So we can set the text without walking the tree again.
+    // When we can't be sure to get the same result as libfolia (e.g. there
+    // are quotes or linebreaks below it) exact is false.
+    UnicodeString text;
+    UnicodeString delim;
+    bool exact = true;
+    void add( const UnicodeString& txt, const UnicodeString& d ){
+      if ( txt.isEmpty() ){
+	return;
+      }
+      if ( !text.isEmpty() ){
+	text += delim;
+      }
+      text += txt;
+      delim = d;
+    }
+  };
+
+  void setBuiltText( folia::FoliaElement *root,
+		     const text_builder& tb,
+		     const string& outputclass ){
+    if ( !tb.exact || tb.text.isEmpty() ){
+      appendText( root, outputclass );
+      return;
+    }
+    if ( root->hastext( outputclass )
+	 || root->isSubClass( folia::Linebreak_t ) ){
+      return;
+    }
+    root->settext( TiCC::UnicodeToUTF8(tb.text), outputclass );
+  }
+
   void removeText( folia::FoliaElement *root,
 		   const string& outputclass  ){
     // remove the textcontent in outputclass of root
@@ -683,7 +1167,48 @@ namespace Tokenizer {
     e->replace( node );
   }
 
-  void TokenizerClass::tokenizeElement( folia::FoliaElement * element) {
+  const set<folia::ElementType> sentence_types = { folia::Sentence_t };
+  const set<folia::ElementType> word_types = { folia::Word_t };
+  const set<folia::ElementType> structure_types = { folia::Paragraph_t,
+						    folia::Sentence_t,
+						    folia::Word_t };
+  // the same as libfolia skips when selecting sentences, words etc.
+  const set<folia::ElementType> ignore_types = { folia::Original_t,
+						 folia::Suggestion_t,
+						 folia::Alternative_t,
+						 folia::AlternativeLayers_t };
+
+  bool has_descendant( const folia::FoliaElement *element,
+		       const set<folia::ElementType>& types ){
+    // depth-first search for a node of one of the types. Unlike
+    // sentences(), words() etc. this stops at the first hit and doesn't
+    // build a vector of all of them
+    for ( size_t i = 0; i < element->size(); ++i ){
+      const folia::FoliaElement *child = element->index(i);
+      if ( !child ){
+	continue;
+      }
+      folia::ElementType et = child->element_id();
+      if ( types.find( et ) != types.end() ){
+	return true;
+      }
+      if ( et == folia::Word_t
+	   || et == folia::TextContent_t
+	   || ignore_types.find( et ) != ignore_types.end() ){
+	// no structure below these
+	continue;
+      }
+      if ( has_descendant( child, types ) ){
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void TokenizerClass::tokenizeElement( folia::FoliaElement * element,
+					vector<ElementJob> *jobs ) {
+    // when jobs is given, we don't tokenize, but collect the work to be
+    // done, in document order. (see tokenizeParallel())
     if ( element->isinstance(folia::Word_t)
 	 || element->isinstance(folia::TextContent_t))
       // shortcut
@@ -700,8 +1225,7 @@ namespace Tokenizer {
       // If so: assume that the text is tokenized already, and don't spoil that
       if ( element->isinstance(folia::Paragraph_t) ) {
 	//tokenize paragraph: check for absence of sentences
-	vector<folia::Sentence*> sentences = element->sentences();
-	if (sentences.size() > 0) {
+	if ( has_descendant( element, sentence_types ) ){
 	  // bail out
 	  return;
 	}
@@ -709,8 +1233,7 @@ namespace Tokenizer {
       else if ( ( element->isinstance(folia::Sentence_t) )
 		|| ( element->isinstance(folia::Head_t) ) ) {
 	//tokenize sentence: check for absence of Word's
-	vector<folia::Word*> words = element->words();
-	if (words.size() > 0) {
+	if ( has_descendant( element, word_types ) ){
 	  // bail out
 	  return;
 	}
@@ -718,19 +1241,8 @@ namespace Tokenizer {
       else {
 	// Some other element that contains text. Probably deeper.
 	// look it up. skip all paragraphs and sentences
-	vector<folia::Paragraph*> paragraphs = element->paragraphs();
-	if (paragraphs.size() > 0) {
-	  // already paragraphs, bail out
-	  return;
-	}
-	vector<folia::Sentence*> sentences = element->sentences();
-	if (sentences.size() > 0) {
-	  // already sentences, bail out
-	  return;
-	}
-	vector<folia::Word*> words = element->words();
-	if (words.size() > 0) {
-	  // already words, bail out
+	if ( has_descendant( element, structure_types ) ){
+	  // already paragraphs, sentences or words, bail out
 	  return;
 	}
       }
@@ -742,15 +1254,18 @@ namespace Tokenizer {
 			     " because it already has text in that class." );
 	}
       }
+      // fetch the text only once, for detection AND tokenization
+      UnicodeString text = element->stricttext( inputclass );
       // now let's check our language
       string lan;
       if ( doDetectLang ){
 	lan = get_language( element ); // is there a local element language?
 	if ( lan.empty() ){
 	  // no, so try to detect it!
-	  UnicodeString temp = element->text( inputclass );
-	  temp.toLower();
-	  lan = tc->get_language( TiCC::UnicodeToUTF8(temp) );
+	  vector<string> candidates = guess_languages( text );
+	  if ( !candidates.empty() ){
+	    lan = candidates[0];
+	  }
 	  if ( lan.empty() ){
 	    // too bad
 	    lan = "default";
@@ -792,14 +1307,24 @@ namespace Tokenizer {
       if ( lan != default_language
 	   && lan != "default"
 	   && !element->hasannotation<folia::LangAnnotation>() ){
-	element->doc()->declare( folia::AnnotationType::LANG,
-				 ISO_SET, "annotator='ucto'" );
+	declareOnce( element->doc(), folia::AnnotationType::LANG,
+		     ISO_SET, "annotator='ucto'" );
 	if ( tokDebug >= 2 ){
 	  LOG << "[tokenizeElement] set language to " << lan << endl;
 	}
 	set_language( element, lan );
       }
-      tokenizeSentenceElement( element, lan );
+      if ( jobs ){
+	declareTokens( element->doc(), lan );
+	ElementJob job;
+	job.element = element;
+	job.lang = lan;
+	job.text = text;
+	jobs->push_back( job );
+      }
+      else {
+	tokenizeSentenceElement( element, lan, text );
+      }
       return;
     }
     //recursion step for textless elements
@@ -807,8 +1332,21 @@ namespace Tokenizer {
       LOG << "[tokenizeElement] Processing children of FoLiA element " << element->id() << endl;
     }
     for ( size_t i = 0; i < element->size(); i++) {
-      tokenizeElement( element->index(i));
+      tokenizeElement( element->index(i), jobs );
     }
+    if ( jobs ){
+      // the text of element can only be fixed after the children are done
+      ElementJob job;
+      job.element = element;
+      jobs->push_back( job );
+    }
+    else {
+      fixupText( element );
+    }
+    return;
+  }
+
+  void TokenizerClass::fixupText( folia::FoliaElement *element ){
     if ( text_redundancy == "full" ){
       if ( tokDebug > 0 ) {
 	LOG << "[tokenizeElement] Creating text on " << element->id() << endl;
@@ -821,7 +1359,6 @@ namespace Tokenizer {
       }
       removeText( element, outputclass );
     }
-    return;
   }
 
   int split_nl( const UnicodeString& line,
@@ -830,26 +1367,41 @@ namespace Tokenizer {
     return nl_split.split( line, parts );
   }
 
-  void TokenizerClass::tokenizeSentenceElement( folia::FoliaElement *element,
-						const string& lang ){
-    folia::Document *doc = element->doc();
+  void TokenizerClass::declareTokens( folia::Document *doc,
+				      const string& lang ){
     if ( passthru ){
-      doc->declare( folia::AnnotationType::TOKEN, "passthru", "annotator='ucto', annotatortype='auto', datetime='now()'" );
+      declareOnce( doc, folia::AnnotationType::TOKEN, "passthru", "annotator='ucto', annotatortype='auto', datetime='now()'" );
     }
     else {
-      doc->declare( folia::AnnotationType::TOKEN,
-		    settings[lang]->set_file,
-		    "annotator='ucto', annotatortype='auto', datetime='now()'" );
+      declareOnce( doc, folia::AnnotationType::TOKEN,
+		   settings[lang]->set_file,
+		   "annotator='ucto', annotatortype='auto', datetime='now()'" );
     }
+  }
+
+  void TokenizerClass::tokenizeSentenceElement( folia::FoliaElement *element,
+						const string& lang,
+						const UnicodeString& line ){
+    // line is the (strict) text of element in the inputclass
+    declareTokens( element->doc(), lang );
     if  ( tokDebug > 0 ){
       LOG << "[tokenizeSentenceElement] " << element->id() << endl;
     }
-    UnicodeString line = element->stricttext( inputclass );
     if ( line.isEmpty() ){
       // so no usefull text in this element. skip it
       return;
     }
-    line += " "  + eosmark;
+    vector<Token> outputTokens = tokenizeElementText( line, lang,
+						      element->id() );
+    outputTokensXML( element, outputTokens, 0 );
+  }
+
+  vector<Token> TokenizerClass::tokenizeElementText( const UnicodeString& text,
+						     const string& lang,
+						     const string& id ){
+    // tokenize the text of 1 FoLiA element. Only the token buffer is used,
+    // the FoLiA document isn't touched
+    UnicodeString line = text + " "  + eosmark;
     if ( tokDebug >= 1 ){
       LOG << "[tokenizeSentenceElement] Processing sentence:"
 		      << line << endl;
@@ -869,7 +1421,7 @@ namespace Tokenizer {
 	if ( tokDebug >= 1 ){
 	  LOG << "[tokenizeSentenceElement] tokenize part: " << l << endl;
 	}
-	tokenizeLine( l, lang, element->id() );
+	tokenizeLine( l, lang, id );
 	if ( &l != &parts.back() ){
 	  // append '<br'>
 	  Token T( "type_linebreak", "\n", LINEBREAK, "" );
@@ -884,17 +1436,151 @@ namespace Tokenizer {
     int numS = countSentences(true); //force buffer to empty
     vector<Token> outputTokens;
     extractSentencesAndFlush( numS, outputTokens, lang );
-    outputTokensXML( element, outputTokens, 0 );
+    return outputTokens;
+  }
+
+  TokenizerClass *TokenizerClass::createWorker() const {
+    // create a TokenizerClass with the same options and settings as this
+    // one. It has its own token buffer, quote stack and regex matchers,
+    // so it can run in another thread
+    TokenizerClass *w = new TokenizerClass();
+    w->tokDebug = tokDebug;
+    w->verbose = verbose;
+    w->detectQuotes = detectQuotes;
+    w->doFilter = doFilter;
+    w->doPunctFilter = doPunctFilter;
+    w->splitOnly = splitOnly;
+    w->detectPar = detectPar;
+    w->doDetectLang = doDetectLang;
+    w->detect_unit = detect_unit;
+    w->detect_chars = detect_chars;
+    w->sticky_lang = sticky_lang;
+    w->text_redundancy = text_redundancy;
+    w->sentenceperlineoutput = sentenceperlineoutput;
+    w->sentenceperlineinput = sentenceperlineinput;
+    w->lowercase = lowercase;
+    w->uppercase = uppercase;
+    w->xmlout = xmlout;
+    w->xmlin = xmlin;
+    w->passthru = passthru;
+    w->profile_rules = profile_rules;
+    w->rule_time_limit = rule_time_limit;
+    w->line_budget = line_budget;
+    w->long_word_policy = long_word_policy;
+    w->slow_log = slow_log;
+    w->slow_threshold = slow_threshold;
+    w->inputclass = inputclass;
+    w->outputclass = outputclass;
+    w->eosmark = eosmark;
+    w->norm_set = norm_set;
+    w->inputEncoding = inputEncoding;
+    w->normalizer.setMode( normalizer.getMode() );
+    w->default_language = default_language;
+    map<const Setting*,Setting*> copies;
+    for ( const auto& s : settings ){
+      // the 'default' Setting is shared with a real language. keep it so
+      auto it = copies.find( s.second );
+      if ( it == copies.end() ){
+	it = copies.insert( make_pair( s.second, s.second->clone() ) ).first;
+      }
+      w->settings[s.first] = it->second;
+    }
+    return w;
+  }
+
+  void TokenizerClass::tokenizeParallel( folia::Document& doc ) {
+    // first collect all elements to tokenize, in document order.
+    // declarations and languages are set here, serially
+    vector<ElementJob> jobs;
+    for ( size_t i = 0; i < doc.doc()->size(); i++) {
+      tokenizeElement( doc.doc()->index(i), &jobs );
+    }
+    if ( tokDebug > 0 ){
+      LOG << "[tokenizeParallel] " << jobs.size() << " jobs, using "
+	  << numThreads << " threads" << endl;
+    }
+    vector<TokenizerClass*> workers;
+    for ( int i=0; i < numThreads; ++i ){
+      TokenizerClass *w = createWorker();
+      w->paragraphsignal = false;
+      workers.push_back( w );
+    }
+    // then tokenize the texts in parallel. No FoLiA is touched here
+    // an exception may not escape the parallel region, so they are kept
+    // per job and the first one is rethrown afterwards
+    int num_jobs = jobs.size();
+    vector<exception_ptr> errors( num_jobs );
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(numThreads)
+#endif
+    for ( int i=0; i < num_jobs; ++i ){
+      ElementJob& job = jobs[i];
+      if ( job.lang.empty() || job.text.isEmpty() ){
+	continue;
+      }
+#ifdef HAVE_OPENMP
+      TokenizerClass *w = workers[omp_get_thread_num()];
+#else
+      TokenizerClass *w = workers[0];
+#endif
+      try {
+	job.result = w->tokenizeElementText( job.text, job.lang,
+					     job.element->id() );
+      }
+      catch ( ... ){
+	errors[i] = current_exception();
+      }
+    }
+    for ( const auto w : workers ){
+      stats += w->stats;
+      if ( profile_rules ){
+	for ( const auto& it : w->rule_profile ){
+	  RuleStats& rs = rule_profile[it.first];
+	  rs.attempts += it.second.attempts;
+	  rs.matches += it.second.matches;
+	  rs.timeouts += it.second.timeouts;
+	  rs.seconds += it.second.seconds;
+	}
+	if ( depth_profile.size() < w->depth_profile.size() ){
+	  depth_profile.resize( w->depth_profile.size() );
+	}
+	for ( size_t i = 0; i < w->depth_profile.size(); ++i ){
+	  depth_profile[i] += w->depth_profile[i];
+	}
+      }
+      delete w;
+    }
+    for ( const auto& e : errors ){
+      if ( e ){
+	rethrow_exception( e );
+      }
+    }
+    // and finally add the results to the document, again in document order
+    // so all generated id's are the same as in a serial run
+    for ( auto& job : jobs ){
+      if ( job.lang.empty() ){
+	fixupText( job.element );
+      }
+      else if ( !job.result.empty() ){
+	if ( paragraphsignal ){
+	  job.result[0].role |= NEWPARAGRAPH | BEGINOFSENTENCE;
+	  paragraphsignal = false;
+	}
+	outputTokensXML( job.element, job.result, 0 );
+      }
+    }
   }
 
   void TokenizerClass::outputTokensDoc_init( folia::Document& doc ) const {
+    declared_doc = &doc;
+    declared.clear();
     doc.addStyle( "text/xsl", "folia.xsl" );
     if ( passthru ){
-      doc.declare( folia::AnnotationType::TOKEN, "passthru", "annotator='ucto', annotatortype='auto', datetime='now()'" );
+      declareOnce( &doc, folia::AnnotationType::TOKEN, "passthru", "annotator='ucto', annotatortype='auto', datetime='now()'" );
     }
     else {
       for ( const auto& s : settings ){
-	doc.declare( folia::AnnotationType::TOKEN, s.second->set_file,
+	declareOnce( &doc, folia::AnnotationType::TOKEN, s.second->set_file,
 		     "annotator='ucto', annotatortype='auto', datetime='now()'");
       }
     }
@@ -905,6 +1591,7 @@ namespace Tokenizer {
   int TokenizerClass::outputTokensXML( folia::FoliaElement *root,
 				       const vector<Token>& tv,
 				       int parCount ) const {
+    phase_timer timer( stats.output_sec );
     short quotelevel = 0;
     folia::FoliaElement *lastS = root;
     if  (tokDebug > 0) {
@@ -929,6 +1616,46 @@ namespace Tokenizer {
       root_is_structure_element = true;
     }
 
+    // with text_redundancy 'full', the text of the elements we create is
+    // built up from the words, instead of asking libfolia for it.
+    const bool build_text = ( text_redundancy == "full" );
+    map<folia::FoliaElement*,text_builder> built;
+    if ( build_text ){
+      text_builder& tb = built[root];
+      for ( size_t i = 0; i < root->size(); ++i ){
+	// only when there is nothing else below root than text and
+	// language, we know for sure what libfolia would make of it
+	const folia::FoliaElement *child = root->index(i);
+	if ( child
+	     && !child->isinstance( folia::TextContent_t )
+	     && !child->isinstance( folia::LangAnnotation_t ) ){
+	  tb.exact = false;
+	  break;
+	}
+      }
+    }
+    auto close_text = [&]( folia::FoliaElement *e ){
+      if ( text_redundancy == "full" ){
+	if ( tokDebug > 0 ) {
+	  LOG << "[outputTokensXML] Creating text on root: " << e->id() << endl;
+	}
+	const text_builder& tb = built[e];
+	setBuiltText( e, tb, outputclass );
+	auto pit = built.find( e->parent() );
+	if ( pit != built.end() ){
+	  pit->second.add( tb.text,
+			   e->isinstance( folia::Paragraph_t )?"\n\n":" " );
+	  pit->second.exact = pit->second.exact && tb.exact;
+	}
+      }
+      else if ( text_redundancy == "none" ){
+	if ( tokDebug > 0 ) {
+	  LOG << "[outputTokensXML] Removing text from root: " << e->id() << endl;
+	}
+	removeText( e, outputclass );
+      }
+    };
+
     bool in_paragraph = false;
     for ( const auto& token : tv ) {
       if ( ( !root_is_structure_element && !root_is_sentence ) //TODO: instead of !root_is_structurel check if is_structure and accepts paragraphs?
@@ -938,18 +1665,7 @@ namespace Tokenizer {
 	  LOG << "[outputTokensXML] Creating paragraph" << endl;
 	}
 	if ( in_paragraph ){
-	  if ( text_redundancy == "full" ){
-	    if ( tokDebug > 0 ) {
-	      LOG << "[outputTokensXML] Creating text on root: " << root->id() << endl;
-	    }
-	    appendText( root, outputclass );
-	  }
-	  else if ( text_redundancy == "none" ){
-	    if ( tokDebug > 0 ) {
-	      LOG << "[outputTokensXML] Removing text from root: " << root->id() << endl;
-	    }
-	    removeText( root, outputclass );
-	  }
+	  close_text( root );
 	  root = root->parent();
 	}
 	folia::KWargs args;
@@ -957,6 +1673,9 @@ namespace Tokenizer {
 	folia::FoliaElement *p = new folia::Paragraph( args, root->doc() );
 	//	LOG << "created " << p << endl;
 	root->append( p );
+	if ( build_text ){
+	  built[p];
+	}
 	root = p;
 	quotelevel = 0;
       }
@@ -977,6 +1696,9 @@ namespace Tokenizer {
 	}
 	folia::FoliaElement *lb = new folia::Linebreak();
 	root->append( lb );
+	if ( build_text ){
+	  built[root].exact = false;
+	}
 	if  (tokDebug > 0){
 	  LOG << "[outputTokensXML] back to " << root->classname() << endl;
 	}
@@ -998,6 +1720,9 @@ namespace Tokenizer {
 	}
 	folia::FoliaElement *s = new folia::Sentence( args, root->doc() );
 	root->append( s );
+	if ( build_text ){
+	  built[s];
+	}
 	string tok_lan = token.lc;
 	auto it = settings.find(tok_lan);
 	if ( it == settings.end() ){
@@ -1009,8 +1734,8 @@ namespace Tokenizer {
 	  if  (tokDebug > 0) {
 	    LOG << "[outputTokensXML] set language: " << tok_lan << endl;
 	  }
-	  s->doc()->declare( folia::AnnotationType::LANG,
-			     ISO_SET, "annotator='ucto'" );
+	  declareOnce( s->doc(), folia::AnnotationType::LANG,
+		       ISO_SET, "annotator='ucto'" );
 	  set_language( s, tok_lan );
 	}
 	root = s;
@@ -1055,6 +1780,9 @@ namespace Tokenizer {
 	  out.toUpper();
 	}
 	w->settext( TiCC::UnicodeToUTF8( out ), outputclass );
+	if ( build_text ){
+	  built[root].add( out, (token.role & NOSPACE)?"":" " );
+	}
 	if ( tokDebug > 1 ) {
 	  LOG << "created " << w << " text= " <<  token.us  << "(" << outputclass << ")" << endl;
 	}
@@ -1074,6 +1802,9 @@ namespace Tokenizer {
 	folia::FoliaElement *q = new folia::Quote( args, root->doc() );
 	//	LOG << "created " << q << endl;
 	root->append( q );
+	if ( build_text ){
+	  built[root].exact = false;
+	}
 	root = q;
 	quotelevel++;
       }
@@ -1081,15 +1812,15 @@ namespace Tokenizer {
 	if  (tokDebug > 0) {
 	  LOG << "[outputTokensXML] End of sentence" << endl;
 	}
-	if ( text_redundancy == "full" ){
-	  appendText( root, outputclass );
-	}
-	else if ( text_redundancy == "none" ){
-	  removeText( root, outputclass );
-	}
+	close_text( root );
 	if ( token.role & LINEBREAK ){
 	  folia::FoliaElement *lb = new folia::Linebreak();
 	  root->append( lb );
+	  if ( build_text ){
+	    // the linebreak comes after the text we already set on the
+	    // sentence, so the parent can't use that anymore
+	    built[root->parent()].exact = false;
+	  }
 	}
 	root = root->parent();
 	lastS = root;
@@ -1100,18 +1831,7 @@ namespace Tokenizer {
       in_paragraph = true;
     }
     if ( tv.size() > 0 ){
-      if ( text_redundancy == "full" ){
-	if ( tokDebug > 0 ) {
-	  LOG << "[outputTokensXML] Creating text on root: " << root->id() << endl;
-	}
-	appendText( root, outputclass );
-      }
-      else if ( text_redundancy == "none" ){
-	if ( tokDebug > 0 ) {
-	  LOG << "[outputTokensXML] Removing text from root: " << root->id() << endl;
-	}
-	removeText( root, outputclass );
-      }
+      close_text( root );
     }
     if ( tokDebug > 0 ) {
       LOG << "[outputTokensXML] Done. parCount= " << parCount << endl;
@@ -1125,6 +1845,7 @@ namespace Tokenizer {
     // continued should be set to true when outputTokens is invoked multiple
     // times and it is not the first invokation
     // this makes paragraph boundaries work over multiple calls
+    phase_timer timer( stats.output_sec );
     short quotelevel = 0;
     bool first = true;
     for ( const auto token : tokens ) {
@@ -1219,7 +1940,7 @@ namespace Tokenizer {
     //Performs  extra sanity checks at the same time! Making sure
     //BEGINOFSENTENCE and ENDOFSENTENCE always pair up, and that TEMPENDOFSENTENCE roles
     //are converted to proper ENDOFSENTENCE markers
-
+    phase_timer timer( stats.sentence_sec );
     short quotelevel = 0;
     int count = 0;
     const int size = tokens.size();
@@ -1284,6 +2005,7 @@ namespace Tokenizer {
       if ((tokens[i].role & ENDOFSENTENCE) && (quotelevel == 0)) {
 	begin = i + 1;
 	--sentences;
+	++stats.sentences;
       }
     }
     if (begin == 0) {
@@ -1378,14 +2100,120 @@ namespace Tokenizer {
   }
 
   // FBK: return true if character is a quote.
-  bool TokenizerClass::u_isquote( UChar32 c, const Quoting& quotes ) const {
-    bool quote = false;
+  bool u_isemo( UChar32 c ){
+    UBlockCode s = ublock_getCode(c);
+    return s == UBLOCK_EMOTICONS;
+  }
+
+  bool u_ispicto( UChar32 c ){
+    UBlockCode s = ublock_getCode(c);
+    return s == UBLOCK_MISCELLANEOUS_SYMBOLS_AND_PICTOGRAPHS ;
+  }
+
+  bool u_iscurrency( UChar32 c ){
+    return u_charType( c ) == U_CURRENCY_SYMBOL;
+  }
+
+  bool u_issymbol( UChar32 c ){
+    return u_charType( c ) == U_CURRENCY_SYMBOL
+      || u_charType( c ) == U_MATH_SYMBOL
+      || u_charType( c ) == U_MODIFIER_SYMBOL
+      || u_charType( c ) == U_OTHER_SYMBOL;
+  }
+
+  // ucto's own classes of characters. A character can be in several.
+  typedef unsigned short char_flags;
+  const char_flags CF_SPACE = 1;
+  const char_flags CF_CURRENCY = 2;
+  const char_flags CF_PUNCT = 4;
+  const char_flags CF_EMO = 8;
+  const char_flags CF_PICTO = 16;
+  const char_flags CF_ALPHA = 32;
+  const char_flags CF_DIGIT = 64;
+  const char_flags CF_SYMBOL = 128;
+  const char_flags CF_QUOTE = 256;   // a quote in every language
+  const char_flags CF_UPPER = 512;   // upper- or titlecase
+  const char_flags CF_BOS = 1024;    // CF_UPPER in a script that has case
+
+  char_flags compute_flags( UChar32 c ){
+    char_flags f = 0;
+    if ( u_isspace( c ) ) f |= CF_SPACE;
+    if ( u_iscurrency( c ) ) f |= CF_CURRENCY;
+    if ( u_ispunct( c ) ) f |= CF_PUNCT;
+    if ( u_isemo( c ) ) f |= CF_EMO;
+    if ( u_ispicto( c ) ) f |= CF_PICTO;
+    if ( u_isalpha( c ) ) f |= CF_ALPHA;
+    if ( u_isdigit( c ) ) f |= CF_DIGIT;
+    if ( u_issymbol( c ) ) f |= CF_SYMBOL;
     if ( u_hasBinaryProperty( c, UCHAR_QUOTATION_MARK )
 	 || c == '`'
 	 || c == U'´' ) {
       // M$ users use the spacing grave and acute accents often as a
       // quote (apostroph) but is DOESN`T have the UCHAR_QUOTATION_MARK property
       // so trick that
+      f |= CF_QUOTE;
+    }
+    if ( u_isupper( c ) || u_istitle( c ) ){
+      f |= CF_UPPER;
+      UBlockCode s = ublock_getCode(c);
+      //test for languages that distinguish case
+      if ( (s == UBLOCK_BASIC_LATIN) || (s == UBLOCK_GREEK)
+	   || (s == UBLOCK_CYRILLIC) || (s == UBLOCK_GEORGIAN)
+	   || (s == UBLOCK_ARMENIAN) || (s == UBLOCK_DESERET)) {
+	f |= CF_BOS;
+      }
+    }
+    return f;
+  }
+
+  // the table covers the BMP and the SMP (emoticons etc.). The other
+  // planes are rare, and computed when needed
+  const UChar32 table_limit = 0x20000;
+
+  class CharTable {
+    // a two-level lookup table of the char_flags of code points, indexed
+    // on the high and the low byte. Equal blocks are stored only once, so
+    // the unassigned and the uniform (CJK, Hangul) ranges take little room
+  public:
+    CharTable(){
+      map<vector<char_flags>,unsigned short> known;
+      for ( UChar32 hi = 0; hi < table_limit >> 8; ++hi ){
+	vector<char_flags> block( 256 );
+	for ( UChar32 lo = 0; lo < 256; ++lo ){
+	  block[lo] = compute_flags( (hi << 8) | lo );
+	}
+	auto it = known.find( block );
+	if ( it == known.end() ){
+	  it = known.insert( make_pair( block, blocks.size() / 256 ) ).first;
+	  blocks.insert( blocks.end(), block.begin(), block.end() );
+	}
+	index.push_back( it->second );
+      }
+    };
+    char_flags get( UChar32 c ) const {
+      if ( c >= 0 && c < table_limit ){
+	return blocks[ (index[c >> 8] << 8) | ( c & 0xFF ) ];
+      }
+      return compute_flags( c );
+    };
+  private:
+    vector<unsigned short> index;
+    vector<char_flags> blocks;
+  };
+
+  const CharTable& char_table(){
+    // built once, on first use. (thread safe)
+    static const CharTable table;
+    return table;
+  }
+
+  inline char_flags char_class( UChar32 c ){
+    return char_table().get( c );
+  }
+
+  bool TokenizerClass::u_isquote( UChar32 c, const Quoting& quotes ) const {
+    bool quote = false;
+    if ( char_class( c ) & CF_QUOTE ) {
       quote = true;
     }
     else {
@@ -1407,18 +2235,8 @@ namespace Tokenizer {
   //MOSTLY THE SAME AS ABOVE, EXCEPT WITHOUT CHECK FOR PUNCTUATION
   //BECAUSE: '"Hoera!", zei de man' MUST NOT BE SPLIT ON ','..
   bool is_BOS( UChar32 c ){
-    bool is_bos = false;
-    UBlockCode s = ublock_getCode(c);
-    //test for languages that distinguish case
-    if ( (s == UBLOCK_BASIC_LATIN) || (s == UBLOCK_GREEK)
-	 || (s == UBLOCK_CYRILLIC) || (s == UBLOCK_GEORGIAN)
-	 || (s == UBLOCK_ARMENIAN) || (s == UBLOCK_DESERET)) {
-      if ( u_isupper(c) || u_istitle(c) ) {
-	//next 'word' starts with more punctuation or with uppercase
-	is_bos = true;
-      }
-    }
-    return is_bos;
+    // uppercase, in a language that distinguishes case
+    return char_class( c ) & CF_BOS;
   }
 
   bool TokenizerClass::resolveQuote( int endindex,
@@ -1537,7 +2355,7 @@ namespace Tokenizer {
 	    is_eos = true;
 	  else if ( i + 2 < tokens.size() ) {
 	    UChar32 c = tokens[i+2].us.char32At(0);
-	    if ( u_isupper(c) || u_istitle(c) || u_ispunct(c) ){
+	    if ( char_class( c ) & ( CF_UPPER | CF_PUNCT ) ){
 	      //next 'word' after quote starts with uppercase or is punct
 	      is_eos = true;
 	    }
@@ -1545,7 +2363,7 @@ namespace Tokenizer {
 	}
 	else if ( tokens[i].us.length() > 1 ){
 	  // PUNCTUATION multi...
-	  if ( u_isupper(c) || u_istitle(c) )
+	  if ( char_class( c ) & CF_UPPER )
 	    is_eos = true;
 	}
 	else
@@ -1615,7 +2433,7 @@ namespace Tokenizer {
   }
 
   void TokenizerClass::detectSentenceBounds( const int offset,
-					     const string& lang ){
+					     const LangContext& ctx ){
     //find sentences
     const int size = tokens.size();
     for (int i = offset; i < size; i++) {
@@ -1631,9 +2449,7 @@ namespace Tokenizer {
 			  << i << endl;
 	}
 	// we have some kind of punctuation. Does it mark an eos?
-	bool is_eos = detectEos( i,
-				 settings[lang]->eosmarkers,
-				 settings[lang]->quotes );
+	bool is_eos = detectEos( i, *ctx.eosmarkers, *ctx.quotes );
 	if (is_eos) {
 	  if ((tokDebug > 1 )){
 	    LOG << "[detectSentenceBounds] EOS FOUND @i="
@@ -1692,7 +2508,7 @@ namespace Tokenizer {
   }
 
   void TokenizerClass::detectQuotedSentenceBounds( const int offset,
-						   const string& lang ){
+						   const LangContext& ctx ){
     //find sentences
     const int size = tokens.size();
     for (int i = offset; i < size; i++) {
@@ -1703,11 +2519,9 @@ namespace Tokenizer {
       }
       if ( tokens[i].type.startsWith("PUNCTUATION") ){
 	// we have some kind of punctuation. Does it mark an eos?
-	bool is_eos = detectEos( i,
-				 settings[lang]->eosmarkers,
-				 settings[lang]->quotes );
+	bool is_eos = detectEos( i, *ctx.eosmarkers, *ctx.quotes );
 	if (is_eos) {
-	  if ( !settings[lang]->quotes.emptyStack() ) {
+	  if ( !ctx.quotes->emptyStack() ) {
 	    if ( tokDebug > 1 ){
 	      LOG << "[detectQuotedSentenceBounds] Preliminary EOS FOUND @i=" << i << endl;
 	    }
@@ -1748,9 +2562,59 @@ namespace Tokenizer {
 	  }
 	}
 	//check quotes
-	detectQuoteBounds( i, settings[lang]->quotes );
+	detectQuoteBounds( i, *ctx.quotes );
+      }
+    }
+  }
+
+  const UnicodeString& passthru_type( const UnicodeString& word ){
+    // the type of a word, only based on the classes of its characters
+    bool alpha = false, num = false, punct = false;
+    for ( int32_t i = 0; i < word.length(); i = word.moveIndex32( i, 1 ) ){
+      const char_flags f = char_class( word.char32At( i ) );
+      if ( f & CF_ALPHA ) {
+	alpha = true;
+      }
+      else if ( f & CF_PUNCT ) {
+	punct = true;
+      }
+      else if ( f & CF_DIGIT ) {
+	num = true;
+      }
+    }
+    if (alpha && !num && !punct) {
+      return type_word;
+    }
+    else if (num && !alpha && !punct) {
+      return type_number;
+    }
+    else if (punct && !alpha && !num) {
+      return type_punctuation;
+    }
+    else {
+      return type_unknown;
+    }
+  }
+
+  void TokenizerClass::fallbackWord( const UnicodeString& word,
+				     bool space,
+				     const LangContext& ctx ){
+    // the cheap way to tokenize a word, as passthruLine() does, for when
+    // a line is over its budget
+    UnicodeString type = passthru_type( word );
+    if ( doPunctFilter && type == type_punctuation ){
+      if ( !tokens.empty() && tokens.back().role & NOSPACE ){
+	tokens.back().role ^= NOSPACE;
       }
+      return;
+    }
+    UnicodeString out = word;
+    if ( norm_set.find( type ) != norm_set.end() ){
+      out = "{{" + type + "}}";
     }
+    TokenRole role = space ? NOROLE : NOSPACE;
+    tokens.push_back( Token( type, out, role | FALLBACK, ctx.lang ) );
+    ++stats.fallback_tokens;
   }
 
   void TokenizerClass::passthruLine( const string& s, bool& bos ) {
@@ -1763,12 +2627,14 @@ namespace Tokenizer {
     if (tokDebug) {
       LOG << "[passthruLine] input: line=[" << input << "]" << endl;
     }
-    bool alpha = false, num = false, punct = false;
+    phase_timer timer( stats.tokenize_sec );
+    const size_t begin_size = tokens.size();
     UnicodeString word;
     StringCharacterIterator sit(input);
     while ( sit.hasNext() ){
       UChar32 c = sit.current32();
-      if ( u_isspace(c)) {
+      const char_flags f = char_class( c );
+      if ( f & CF_SPACE ) {
 	if ( word.isEmpty() ){
 	  // a leading space. Don't waste time on it. SKIP
 	  sit.next32();
@@ -1785,19 +2651,7 @@ namespace Tokenizer {
 	  bos = true;
 	}
 	else {
-	  UnicodeString type;
-	  if (alpha && !num && !punct) {
-	    type = type_word;
-	  }
-	  else if (num && !alpha && !punct) {
-	    type = type_number;
-	  }
-	  else if (punct && !alpha && !num) {
-	    type = type_punctuation;
-	  }
-	  else {
-	    type = type_unknown;
-	  }
+	  UnicodeString type = passthru_type( word );
 	  if ( doPunctFilter
 	       && ( type == type_punctuation || type == type_currency ||
 		    type == type_emoticon || type == type_picto ) ) {
@@ -1821,22 +2675,10 @@ namespace Tokenizer {
 	      tokens.push_back( Token( type, word ) );
 	    }
 	  }
-	  alpha = false;
-	  num = false;
-	  punct = false;
           word = "";
 	}
       }
       else {
-	if ( u_isalpha(c)) {
-	  alpha = true;
-	}
-	else if (u_ispunct(c)) {
-	  punct = true;
-	}
-	else if (u_isdigit(c)) {
-	  num = true;
-	}
 	word += c;
       }
       sit.next32();
@@ -1848,19 +2690,7 @@ namespace Tokenizer {
 	  tokens.back().role |= ENDOFSENTENCE;
       }
       else {
-	UnicodeString type;
-	if (alpha && !num && !punct) {
-	  type = type_word;
-	}
-	else if (num && !alpha && !punct) {
-	  type = type_number;
-	}
-	else if (punct && !alpha && !num) {
-	  type = type_punctuation;
-	}
-	else {
-	  type = type_unknown;
-	}
+	UnicodeString type = passthru_type( word );
 	if ( doPunctFilter
 	     && ( type == type_punctuation || type == type_currency ||
 		  type == type_emoticon || type == type_picto ) ) {
@@ -1886,6 +2716,7 @@ namespace Tokenizer {
 	}
       }
     }
+    stats.tokens += tokens.size() - begin_size;
     if ( sentenceperlineinput && tokens.size() > 0 ) {
       tokens[0].role |= BEGINOFSENTENCE;
       tokens.back().role |= ENDOFSENTENCE;
@@ -1934,50 +2765,30 @@ namespace Tokenizer {
     return tokenizeLine( u, lang, "" );
   }
 
-  bool u_isemo( UChar32 c ){
-    UBlockCode s = ublock_getCode(c);
-    return s == UBLOCK_EMOTICONS;
-  }
-
-  bool u_ispicto( UChar32 c ){
-    UBlockCode s = ublock_getCode(c);
-    return s == UBLOCK_MISCELLANEOUS_SYMBOLS_AND_PICTOGRAPHS ;
-  }
-
-  bool u_iscurrency( UChar32 c ){
-    return u_charType( c ) == U_CURRENCY_SYMBOL;
-  }
-
-  bool u_issymbol( UChar32 c ){
-    return u_charType( c ) == U_CURRENCY_SYMBOL
-      || u_charType( c ) == U_MATH_SYMBOL
-      || u_charType( c ) == U_MODIFIER_SYMBOL
-      || u_charType( c ) == U_OTHER_SYMBOL;
-  }
-
   const UnicodeString& detect_type( UChar32 c ){
-    if ( u_isspace(c)) {
+    const char_flags f = char_class( c );
+    if ( f & CF_SPACE ) {
       return type_space;
     }
-    else if ( u_iscurrency(c)) {
+    else if ( f & CF_CURRENCY ) {
       return type_currency;
     }
-    else if ( u_ispunct(c)) {
+    else if ( f & CF_PUNCT ) {
       return type_punctuation;
     }
-    else if ( u_isemo( c ) ) {
+    else if ( f & CF_EMO ) {
       return type_emoticon;
     }
-    else if ( u_ispicto( c ) ) {
+    else if ( f & CF_PICTO ) {
       return type_picto;
     }
-    else if ( u_isalpha(c)) {
+    else if ( f & CF_ALPHA ) {
       return type_word;
     }
-    else if ( u_isdigit(c)) {
+    else if ( f & CF_DIGIT ) {
       return type_number;
     }
-    else if ( u_issymbol(c)) {
+    else if ( f & CF_SYMBOL ) {
       return type_symbol;
     }
     else {
@@ -2053,30 +2864,135 @@ namespace Tokenizer {
     }
   }
 
-  int TokenizerClass::tokenizeLine( const UnicodeString& originput,
-				    const string& _lang,
-				    const string& id ){
+  TokenizerClass::LangContext TokenizerClass::get_context( const string& _lang ){
     string lang = _lang;
     if ( lang.empty() ){
       lang = "default";
     }
-    else {
-      auto const it = settings.find( lang );
-      if ( it == settings.end() ){
-	LOG << "tokenizeLine: no settings found for language=" + lang << endl
-	    << "using the default language instead:" << default_language << endl;
-	lang = "default";
+    auto it = settings.find( lang );
+    if ( it == settings.end() ){
+      LOG << "tokenizeLine: no settings found for language=" + lang << endl
+	  << "using the default language instead:" << default_language << endl;
+      lang = "default";
+      it = settings.find( lang );
+    }
+    Setting *set = it->second;
+    if ( !set->isCompiled() ){
+      // first use of a lazily loaded language
+      set->compile();
+    }
+    if ( set->time_limit != rule_time_limit ){
+      set->setTimeLimit( rule_time_limit );
+    }
+    LangContext result;
+    result.lang = lang;
+    result.set = set;
+    result.rules = &set->rules;
+    result.eosmarkers = &set->eosmarkers;
+    result.quotes = &set->quotes;
+    result.filter = &set->filter;
+    return result;
+  }
+
+  bool quick_normalized( const UnicodeString& s, const string& mode ){
+    // true when s is certainly in normalization form 'mode' already.
+    // For most text this is much cheaper than normalizing it
+    UErrorCode err = U_ZERO_ERROR;
+    const Normalizer2 *norm = 0;
+    if ( mode == "NFC" ){
+      norm = Normalizer2::getNFCInstance( err );
+    }
+    else if ( mode == "NFD" ){
+      norm = Normalizer2::getNFDInstance( err );
+    }
+    else if ( mode == "NFKC" ){
+      norm = Normalizer2::getNFKCInstance( err );
+    }
+    else if ( mode == "NFKD" ){
+      norm = Normalizer2::getNFKDInstance( err );
+    }
+    if ( !norm || U_FAILURE( err ) ){
+      return false;
+    }
+    int32_t end = norm->spanQuickCheckYes( s, err );
+    return U_SUCCESS( err ) && end == s.length();
+  }
+
+  // the classes of characters that tokenizeLine() cares about
+  const unsigned char CC_OTHER = 0;
+  const unsigned char CC_SPACE = 1;
+  const unsigned char CC_SPECIAL = 2; // punctuation, digit, quote or emoticon
+
+  const UnicodeString& TokenizerClass::prepare_line( const UnicodeString& in,
+						     const LangContext& ctx ){
+    // normalize and filter a line, and classify all its characters into
+    // char_classes, in one pass. The line is only copied when normalizing
+    // or filtering really changes something.
+    const UnicodeString *line = &in;
+    {
+      phase_timer timer( stats.normalize_sec );
+      if ( !quick_normalized( in, normalizer.getMode() ) ){
+	norm_buffer = normalizer.normalize( in );
+	line = &norm_buffer;
+      }
+    }
+    char_classes.clear();
+    if ( line->isBogus() ){
+      return *line;
+    }
+    phase_timer timer( stats.filter_sec );
+    auto classify = [&]( UChar32 c ){
+      const char_flags f = char_class( c );
+      if ( f & CF_SPACE ){
+	return CC_SPACE;
+      }
+      if ( ( f & ( CF_PUNCT | CF_DIGIT | CF_QUOTE | CF_EMO ) )
+	   || u_isquote( c, *ctx.quotes ) ){
+	return CC_SPECIAL;
+      }
+      return CC_OTHER;
+    };
+    bool copied = false;
+    for ( int32_t i = 0; i < line->length(); ){
+      UChar32 c = line->char32At( i );
+      if ( doFilter && ctx.filter->is_filtered( c ) ){
+	if ( !copied ){
+	  filter_buffer.setTo( *line, 0, i );
+	  copied = true;
+	}
+	UnicodeString rep = ctx.filter->filter( UnicodeString( c ) );
+	for ( int32_t j = 0; j < rep.length(); j = rep.moveIndex32( j, 1 ) ){
+	  char_classes.push_back( classify( rep.char32At( j ) ) );
+	}
+	filter_buffer += rep;
+      }
+      else {
+	if ( copied ){
+	  filter_buffer.append( c );
+	}
+	char_classes.push_back( classify( c ) );
       }
+      i += U16_LENGTH( c );
+    }
+    return copied ? filter_buffer : *line;
+  }
+
+  int TokenizerClass::tokenizeLine( const UnicodeString& originput,
+				    const string& _lang,
+				    const string& id ){
+    const auto line_start = chrono::steady_clock::now();
+    const LangContext ctx = get_context( _lang );
+    line_id = id;
+    if ( slow_log ){
+      line_rule_seconds.assign( ctx.rules->size(), 0.0 );
     }
     if (tokDebug){
       LOG << "[tokenizeLine] input: line=["
-	  << originput << "] (" << lang << ")" << endl;
-    }
-    UnicodeString input = normalizer.normalize( originput );
-    if ( doFilter ){
-      input = settings[lang]->filter.filter( input );
+	  << originput << "] (" << ctx.lang << ")" << endl;
     }
+    const UnicodeString& input = prepare_line( originput, ctx );
     if ( input.isBogus() ){ //only tokenize valid input
+      ++stats.invalid_lines;
       if ( id.empty() ){
 	LOG << "ERROR: Invalid UTF-8 in line:" << linenum << endl
 	    << "   '" << input << "'" << endl;
@@ -2087,7 +3003,7 @@ namespace Tokenizer {
       }
       return 0;
     }
-    int32_t len = input.countChar32();
+    int32_t len = char_classes.size();
     if (tokDebug){
       LOG << "[tokenizeLine] filtered input: line=["
 		      << input << "] (" << len
@@ -2098,163 +3014,327 @@ namespace Tokenizer {
       LOG << "[tokenizeLine] Tokens still in buffer: " << begintokencount << endl;
     }
 
+    phase_timer tok_timer( stats.tokenize_sec );
+    // Words are the ranges of non-space characters in input. They are
+    // handed to tokenizeWord() as read-only aliases of input, so they are
+    // never built or copied. The EOS markers are located in one scan.
+    const char16_t *buffer = input.getBuffer();
+    const int32_t eos_len = eosmark.length();
+    vector<int32_t> eos_found;
+    if ( eos_len > 0 ){
+      int32_t p = input.indexOf( eosmark );
+      while ( p >= 0 ){
+	eos_found.push_back( p );
+	p = input.indexOf( eosmark, p+1 );
+      }
+    }
+    bool over_budget = false;
+    auto tokenize_part = [&]( const UnicodeString& part, bool space,
+			      const UnicodeString& type ){
+      // tokenizeWord(), or the fallback when the line is over its budget
+      if ( line_budget >= 0 && !over_budget
+	   && chrono::duration<double,milli>( chrono::steady_clock::now()
+					      - line_start ).count()
+	   >= line_budget ){
+	over_budget = true;
+	++stats.fallback_lines;
+	if ( tokDebug ){
+	  LOG << "[tokenizeLine] line " << linenum << " is over budget, "
+	      << "using the fallback for the rest" << endl;
+	}
+      }
+      if ( over_budget ){
+	fallbackWord( part, space, ctx );
+      }
+      else {
+	tokenizeWord( part, space, ctx, type );
+      }
+    };
+    size_t eos_index = 0;
     bool tokenizeword = false;
-    bool reset = false;
-    //iterate over all characters
-    UnicodeString word;
-    StringCharacterIterator sit(input);
+    int32_t w_begin = -1; // start of the current word. -1 between words
+    int32_t pos = 0;
     long int i = 0;
     long int tok_size = 0;
-    while ( sit.hasNext() ){
-      UChar32 c = sit.current32();
+    while ( pos < input.length() ){
+      UChar32 c = input.char32At( pos );
+      const int32_t next = pos + U16_LENGTH( c );
+      const unsigned char c_class = char_classes[i];
       if ( tokDebug > 8 ){
 	UnicodeString s = c;
 	int8_t charT = u_charType( c );
 	LOG << "examine character: " << s << " type= "
 	    << toString( charT  ) << endl;
       }
-      if (reset) { //reset values for new word
-	reset = false;
-	tok_size = 0;
-	if (!u_isspace(c))
-	  word = c;
-	else
-	  word = "";
-	tokenizeword = false;
+      if ( c_class != CC_SPACE ){
+	if ( w_begin < 0 ){
+	  w_begin = pos;
+	}
+	if ( ++tok_size > max_word_length ){
+	  ++stats.long_words;
+	  string what = "Skipped the line";
+	  if ( long_word_policy == "skip" ){
+	    what = "Skipped the word";
+	  }
+	  else if ( long_word_policy == "chunk" ){
+	    what = "Chunked the word";
+	  }
+	  if ( id.empty() ){
+	    LOG << "Ridiculously long word/token (over " << max_word_length
+		<< " characters) detected in line: " << linenum << ". "
+		<< what << " ..." << endl;
+	    LOG << "The word starts with " << UnicodeString( input, w_begin, 75 )
+		<< "..." << endl;
+	  }
+	  else {
+	    LOG << "Ridiculously long word/token (over " << max_word_length
+		<< " characters) detected in element: " << id << ". "
+		<< what << " ..." << endl;
+	    LOG << "The word starts with " << UnicodeString( input, w_begin, 75 )
+		<< "..." << endl;
+	  }
+	  if ( long_word_policy == "line" ){
+	    return 0;
+	  }
+	  // find the end of the word, without looking at it any further
+	  int32_t w_end = next;
+	  long int j = i + 1;
+	  while ( j < len && char_classes[j] != CC_SPACE ){
+	    w_end += U16_LENGTH( input.char32At( w_end ) );
+	    ++j;
+	  }
+	  if ( long_word_policy == "chunk" ){
+	    for ( int32_t start = w_begin; start < w_end; ){
+	      int32_t end = input.moveIndex32( start, max_word_length );
+	      if ( end > w_end ){
+		end = w_end;
+	      }
+	      UnicodeString chunk( false, buffer + start, end - start );
+	      tokens.push_back( Token( type_longword, chunk,
+				       ( end < w_end ) ? NOSPACE : NOROLE,
+				       ctx.lang ) );
+	      start = end;
+	    }
+	  }
+	  // go on at the space after the word (if any)
+	  pos = w_end;
+	  i = j;
+	  w_begin = -1;
+	  tok_size = 0;
+	  tokenizeword = false;
+	  continue;
+	}
       }
-      else {
-	if ( !u_isspace(c) ){
-	  word += c;
+      if ( c_class == CC_SPECIAL ){
+	if (tokDebug){
+	  LOG << "[tokenizeLine] punctuation or digit detected" << endl;
 	}
+	//there is punctuation or digits in this word, mark to run through tokeniser
+	tokenizeword = true;
       }
-      if ( u_isspace(c) || i == len-1 ){
+      if ( c_class == CC_SPACE || i == len-1 ){
+	UnicodeString word;
+	if ( w_begin >= 0 ){
+	  const int32_t w_end = ( c_class == CC_SPACE ) ? pos : next;
+	  word.setTo( false, buffer + w_begin, w_end - w_begin );
+	}
 	if (tokDebug){
 	  LOG << "[tokenizeLine] space detected, word=["
 			  << word << "]" << endl;
 	}
-	if ( i == len-1 ) {
-	  if ( u_ispunct(c)
-	       || u_isdigit(c)
-	       || u_isquote( c, settings[lang]->quotes )
-	       || u_isemo(c) ){
-	    tokenizeword = true;
+	int expliciteosfound = -1;
+	if ( !word.isEmpty() ){
+	  // the last EOS marker completely inside the word
+	  while ( eos_index < eos_found.size()
+		  && eos_found[eos_index] < w_begin ){
+	    ++eos_index;
+	  }
+	  for ( size_t e = eos_index;
+		e < eos_found.size()
+		  && eos_found[e] + eos_len <= w_begin + word.length();
+		++e ){
+	    expliciteosfound = eos_found[e] - w_begin;
 	  }
 	}
-	int expliciteosfound = -1;
-	if ( word.length() >= eosmark.length() ) {
-	  expliciteosfound = word.lastIndexOf(eosmark);
-
-	  if (expliciteosfound != -1) { // word contains eosmark
-	    if ( tokDebug >= 2){
-	      LOG << "[tokenizeLine] Found explicit EOS marker @"<<expliciteosfound << endl;
-	    }
-	    int eospos = tokens.size()-1;
-	    if (expliciteosfound > 0) {
-	      UnicodeString realword;
-	      word.extract(0,expliciteosfound,realword);
-	      if (tokDebug >= 2) {
-		LOG << "[tokenizeLine] Prefix before EOS: "
-				<< realword << endl;
-	      }
-	      tokenizeWord( realword, false, lang );
-	      eospos++;
+	if (expliciteosfound != -1) { // word contains eosmark
+	  if ( tokDebug >= 2){
+	    LOG << "[tokenizeLine] Found explicit EOS marker @"<<expliciteosfound << endl;
+	  }
+	  int eospos = tokens.size()-1;
+	  if (expliciteosfound > 0) {
+	    UnicodeString realword( false, buffer + w_begin, expliciteosfound );
+	    if (tokDebug >= 2) {
+	      LOG << "[tokenizeLine] Prefix before EOS: "
+			      << realword << endl;
 	    }
-	    if ( expliciteosfound + eosmark.length() < word.length() ){
-	      UnicodeString realword;
-	      word.extract( expliciteosfound+eosmark.length(),
-			    word.length() - expliciteosfound - eosmark.length(),
-			    realword );
-	      if (tokDebug >= 2){
-		LOG << "[tokenizeLine] postfix after EOS: "
-				<< realword << endl;
-	      }
-	      tokenizeWord( realword, true, lang );
+	    tokenize_part( realword, false, "" );
+	    eospos++;
+	  }
+	  if ( expliciteosfound + eos_len < word.length() ){
+	    UnicodeString realword( false,
+				    buffer + w_begin + expliciteosfound + eos_len,
+				    word.length() - expliciteosfound - eos_len );
+	    if (tokDebug >= 2){
+	      LOG << "[tokenizeLine] postfix after EOS: "
+			      << realword << endl;
 	    }
-	    if ( !tokens.empty() && eospos >= 0 ) {
-	      if (tokDebug >= 2){
-		LOG << "[tokenizeLine] Assigned EOS" << endl;
-	      }
-	      tokens[eospos].role |= ENDOFSENTENCE;
+	    tokenize_part( realword, true, "" );
+	  }
+	  if ( !tokens.empty() && eospos >= 0 ) {
+	    if (tokDebug >= 2){
+	      LOG << "[tokenizeLine] Assigned EOS" << endl;
 	    }
+	    tokens[eospos].role |= ENDOFSENTENCE;
 	  }
 	}
-	if ( word.length() > 0
-	     && expliciteosfound == -1 ) {
+	else if ( word.length() > 0 ) {
 	  if (tokDebug >= 2){
 	    LOG << "[tokenizeLine] Further tokenisation necessary for: ["
 			    << word << "]" << endl;
 	  }
 	  if ( tokenizeword ) {
-	    tokenizeWord( word, true, lang );
+	    tokenize_part( word, true, "" );
 	  }
 	  else {
-	    tokenizeWord( word, true, lang, type_word );
+	    tokenize_part( word, true, type_word );
 	  }
 	}
 	//reset values for new word
-	reset = true;
-      }
-      else if ( u_ispunct(c)
-		|| u_isdigit(c)
-		|| u_isquote( c, settings[lang]->quotes )
-		|| u_isemo(c) ){
-	if (tokDebug){
-	  LOG << "[tokenizeLine] punctuation or digit detected, word=["
-			  << word << "]" << endl;
-	}
-	//there is punctuation or digits in this word, mark to run through tokeniser
-	tokenizeword = true;
+	w_begin = -1;
+	tok_size = 0;
+	tokenizeword = false;
       }
-      sit.next32();
+      pos = next;
       ++i;
-      ++tok_size;
-      if ( tok_size > 2500 ){
-	if ( id.empty() ){
-	  LOG << "Ridiculously long word/token (over 2500 characters) detected "
-	      << "in line: " << linenum << ". Skipped ..." << endl;
-	  LOG << "The line starts with " << UnicodeString( word, 0, 75 )
-	      << "..." << endl;
-	}
-	else {
-	  LOG << "Ridiculously long word/token (over 2500 characters) detected "
-	      << "in element: " << id << ". Skipped ..." << endl;
-	  LOG << "The text starts with " << UnicodeString( word, 0, 75 )
-	      << "..." << endl;
-	}
-	return 0;
-      }
     }
+    tok_timer.stop();
     int numNewTokens = tokens.size() - begintokencount;
+    stats.tokens += numNewTokens;
     if ( numNewTokens > 0 ){
+      phase_timer sent_timer( stats.sentence_sec );
       if (paragraphsignal) {
 	tokens[begintokencount].role |= NEWPARAGRAPH | BEGINOFSENTENCE;
 	paragraphsignal = false;
       }
-      //find sentence boundaries
+      //find sentence boundaries. This always uses the EOS markers and the
+      // quote stack of the default language, which are also the ones
+      // flushSentences() clears
+      const LangContext eos_ctx = ( ctx.lang == "default" )
+	? ctx : get_context( "default" );
       if (sentenceperlineinput) {
 	tokens[begintokencount].role |= BEGINOFSENTENCE;
 	tokens.back().role |= ENDOFSENTENCE;
 	if ( detectQuotes ){
-	  detectQuotedSentenceBounds( begintokencount );
+	  detectQuotedSentenceBounds( begintokencount, eos_ctx );
 	}
       }
       else {
 	if ( detectQuotes ){
-	  detectQuotedSentenceBounds( begintokencount );
+	  detectQuotedSentenceBounds( begintokencount, eos_ctx );
 	}
 	else {
-	  detectSentenceBounds( begintokencount );
+	  detectSentenceBounds( begintokencount, eos_ctx );
 	}
       }
     }
+    if ( slow_log ){
+      double ms = chrono::duration<double,milli>( chrono::steady_clock::now()
+						  - line_start ).count();
+      if ( ms >= slow_threshold ){
+	log_slow_line( originput, id, ctx, ms );
+      }
+    }
     return numNewTokens;
   }
 
+  bool TokenizerClass::setSlowLog( const string& file, double ms ){
+    slow_log.reset();
+    slow_threshold = ms;
+    if ( file.empty() ){
+      return true;
+    }
+    ofstream *os = new ofstream( file );
+    if ( !os->good() ){
+      delete os;
+      return false;
+    }
+    *os << "# ms\tlocation\tslowest_rule\trule_ms\ttext" << endl;
+    slow_log.reset( os );
+    return true;
+  }
+
+  void TokenizerClass::log_slow_line( const UnicodeString& line,
+				      const string& id,
+				      const LangContext& ctx,
+				      double ms ){
+    string rule = "-";
+    double rule_ms = 0.0;
+    for ( size_t i = 0; i < line_rule_seconds.size(); ++i ){
+      if ( line_rule_seconds[i] * 1000 > rule_ms ){
+	rule_ms = line_rule_seconds[i] * 1000;
+	rule = TiCC::UnicodeToUTF8( (*ctx.rules)[i]->id );
+      }
+    }
+    string location = id;
+    if ( location.empty() ){
+      location = "line:" + TiCC::toString( linenum );
+    }
+    UnicodeString text = line;
+    text.findAndReplace( "\n", " " );
+    text.findAndReplace( "\r", " " );
+#ifdef HAVE_OPENMP
+#pragma omp critical (slow_log)
+#endif
+    {
+      *slow_log << ms << "\t" << location << "\t" << rule << "\t" << rule_ms
+		<< "\t" << TiCC::UnicodeToUTF8( text ) << endl;
+    }
+  }
+
+  TokenizerStats TokenizerClass::getStats() const {
+    TokenizerStats result = stats;
+    result.buffered_tokens = tokens.size();
+    set<const Setting*> seen; // "default" is an alias of another language
+    for ( const auto& it : settings ){
+      if ( seen.insert( it.second ).second ){
+	result.quote_depth += it.second->quotes.stackSize();
+      }
+    }
+    return result;
+  }
+
+  struct depth_counter {
+    // keeps track of the nesting of tokenizeWord() when profiling
+    explicit depth_counter( int *d ): depth(d) { if ( depth ) ++*depth; };
+    ~depth_counter() { if ( depth ) --*depth; };
+    int *depth;
+  };
+
+  void TokenizerClass::printRuleProfile( ostream& os ) const {
+    os << "rule\tattempts\tmatches\ttimeouts\tseconds" << endl;
+    for ( const auto& it : rule_profile ){
+      os << it.first << "\t" << it.second.attempts
+	 << "\t" << it.second.matches << "\t" << it.second.timeouts
+	 << "\t" << it.second.seconds << endl;
+    }
+    os << "depth\tcalls" << endl;
+    for ( size_t i = 1; i < depth_profile.size(); ++i ){
+      os << i << "\t" << depth_profile[i] << endl;
+    }
+  }
+
   void TokenizerClass::tokenizeWord( const UnicodeString& input,
 				     bool space,
-				     const string& lang,
+				     const LangContext& ctx,
 				     const UnicodeString& assigned_type ) {
     bool recurse = !assigned_type.isEmpty();
+    depth_counter depth( profile_rules ? &word_depth : 0 );
+    if ( profile_rules ){
+      if ( depth_profile.size() <= (size_t)word_depth ){
+	depth_profile.resize( word_depth + 1 );
+      }
+      ++depth_profile[word_depth];
+    }
 
     int32_t inpLen = input.countChar32();
     if ( tokDebug > 2 ){
@@ -2307,7 +3387,7 @@ namespace Tokenizer {
 	if ( norm_set.find( type ) != norm_set.end() ){
 	  word = "{{" + type + "}}";
 	}
-	Token T( type, word, space ? NOROLE : NOSPACE, lang );
+	Token T( type, word, space ? NOROLE : NOSPACE, ctx.lang );
 	tokens.push_back( T );
 	if (tokDebug >= 2){
 	  LOG << "   [tokenizeWord] added token " << T << endl;
@@ -2316,7 +3396,7 @@ namespace Tokenizer {
     }
     else {
       bool a_rule_matched = false;
-      for ( const auto& rule : settings[lang]->rules ) {
+      for ( const auto& rule : *ctx.rules ) {
 	if ( tokDebug >= 4){
 	  LOG << "\tTESTING " << rule->id << endl;
 	}
@@ -2324,7 +3404,44 @@ namespace Tokenizer {
 	//Find first matching rule
 	UnicodeString pre, post;
 	vector<UnicodeString> matches;
-	if ( rule->matchAll( input, pre, post, matches ) ){
+	bool matched;
+	if ( profile_rules || slow_log ){
+	  auto start = chrono::steady_clock::now();
+	  matched = rule->matchAll( input, pre, post, matches );
+	  double seconds = chrono::duration<double>( chrono::steady_clock::now()
+						     - start ).count();
+	  if ( profile_rules ){
+	    RuleStats& stats = rule_profile[rule->id];
+	    ++stats.attempts;
+	    if ( matched ){
+	      ++stats.matches;
+	    }
+	    else if ( rule->timed_out ){
+	      ++stats.timeouts;
+	    }
+	    stats.seconds += seconds;
+	  }
+	  if ( slow_log ){
+	    line_rule_seconds[&rule - ctx.rules->data()] += seconds;
+	  }
+	}
+	else {
+	  matched = rule->matchAll( input, pre, post, matches );
+	}
+	if ( !matched && rule->timed_out ){
+	  ++stats.rule_timeouts;
+	  if ( line_id.empty() ){
+	    LOG << "Rule " << rule->id << " exceeded its time limit on a word "
+		<< "in line: " << linenum << ". Rule skipped ..." << endl;
+	  }
+	  else {
+	    LOG << "Rule " << rule->id << " exceeded its time limit on a word "
+		<< "in element: " << line_id << ". Rule skipped ..." << endl;
+	  }
+	  LOG << "The word starts with " << UnicodeString( input, 0, 75 )
+	      << "..." << endl;
+	}
+	if ( matched ){
 	  a_rule_matched = true;
 	  if ( tokDebug >= 4 ){
 	    LOG << "\tMATCH: " << type << endl;
@@ -2348,7 +3465,7 @@ namespace Tokenizer {
 	      if ( tokDebug >= 4 ){
 		LOG << "\trecurse, match didn't do anything new for " << input << endl;
 	      }
-	      tokens.push_back( Token( assigned_type, input, space ? NOROLE : NOSPACE, lang ) );
+	      tokens.push_back( Token( assigned_type, input, space ? NOROLE : NOSPACE, ctx.lang ) );
 	      return;
 	    }
 	    else {
@@ -2356,7 +3473,7 @@ namespace Tokenizer {
 		LOG << "\trecurse, match changes the type:"
 				<< assigned_type << " to " << type << endl;
 	      }
-	      tokens.push_back( Token( type, input, space ? NOROLE : NOSPACE, lang ) );
+	      tokens.push_back( Token( type, input, space ? NOROLE : NOSPACE, ctx.lang ) );
 	      return;
 	    }
 	  }
@@ -2365,7 +3482,7 @@ namespace Tokenizer {
 	      LOG << "\tTOKEN pre-context (" << pre.length()
 			      << "): [" << pre << "]" << endl;
 	    }
-	    tokenizeWord( pre, false, lang ); //pre-context, no space after
+	    tokenizeWord( pre, false, ctx ); //pre-context, no space after
 	  }
 	  if ( matches.size() > 0 ){
 	    int max = matches.size();
@@ -2399,14 +3516,14 @@ namespace Tokenizer {
 		UnicodeString word = matches[m];
 		if ( norm_set.find( type ) != norm_set.end() ){
 		  word = "{{" + type + "}}";
-		  tokens.push_back( Token( type, word, internal_space ? NOROLE : NOSPACE, lang ) );
+		  tokens.push_back( Token( type, word, internal_space ? NOROLE : NOSPACE, ctx.lang ) );
 		}
 		else {
 		  if ( recurse ){
-		    tokens.push_back( Token( type, word, internal_space ? NOROLE : NOSPACE, lang ) );
+		    tokens.push_back( Token( type, word, internal_space ? NOROLE : NOSPACE, ctx.lang ) );
 		  }
 		  else {
-		    tokenizeWord( word, internal_space, lang, type );
+		    tokenizeWord( word, internal_space, ctx, type );
 		  }
 		}
 	      }
@@ -2421,7 +3538,7 @@ namespace Tokenizer {
 	      LOG << "\tTOKEN post-context (" << post.length()
 			      << "): [" << post << "]" << endl;
 	    }
-	    tokenizeWord( post, space, lang );
+	    tokenizeWord( post, space, ctx );
 	  }
 	  break;
 	}
@@ -2431,7 +3548,7 @@ namespace Tokenizer {
 	if ( tokDebug >=4 ){
 	  LOG << "\tthere's no match at all" << endl;
 	}
-	tokens.push_back( Token( assigned_type, input, space ? NOROLE : NOSPACE , lang ) );
+	tokens.push_back( Token( assigned_type, input, space ? NOROLE : NOSPACE , ctx.lang ) );
       }
     }
   }
@@ -2439,6 +3556,7 @@ namespace Tokenizer {
   bool TokenizerClass::init( const string& fname, const string& tname ){
     LOG << "Initiating tokeniser..." << endl;
     Setting *set = new Setting();
+    set->rule_cache = rule_cache;
     if ( !set->read( fname, tname, tokDebug, theErrLog ) ){
       LOG << "Cannot read Tokeniser settingsfile " << fname << endl;
       LOG << "Unsupported language? (Did you install the uctodata package?)"
@@ -2470,18 +3588,69 @@ namespace Tokenizer {
     if ( tokDebug > 0 ){
       LOG << "Initiating tokeniser from language list..." << endl;
     }
-    Setting *default_set = 0;
-    for ( const auto& lang : languages ){
-      if ( tokDebug > 0 ){
-	LOG << "init language=" << lang << endl;
+    // reading and compiling the settings takes time, so we do all
+    // languages in parallel, and merge the results in order afterwards.
+    // Only the first language gets the additional tokens file. When that
+    // one fails, the next usable language is re-read with it below.
+    // Every language logs to a buffer of its own, which are printed in
+    // order afterwards, so the threads never write to theErrLog at once.
+    vector<Setting*> sets( languages.size(), 0 );
+    vector<exception_ptr> errors( languages.size() );
+    vector<ostringstream> messages( languages.size() );
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic) if( languages.size() > 1 )
+#endif
+    for ( size_t i = 0; i < languages.size(); ++i ){
+      TiCC::LogStream log( messages[i], "", NoStamp );
+      try {
+	if ( tokDebug > 0 ){
+	  log << "init language=" << languages[i] << endl;
+	}
+	unique_ptr<Setting> set( new Setting() );
+	set->rule_cache = rule_cache;
+	// the first language is (mostly) the default, which we need anyway
+	if ( set->read( "tokconfig-" + languages[i],
+			( i == 0 ) ? tname : "",
+			tokDebug, &log,
+			lazy_settings && i > 0 ) ){
+	  set->theErrLog = theErrLog; // log doesn't outlive this loop
+	  sets[i] = set.release();
+	}
       }
-      string fname = "tokconfig-" + lang;
-      Setting *set = new Setting();
-      string add;
-      if ( default_set == 0 ){
-	add = tname;
+      catch ( ... ){
+	errors[i] = current_exception();
       }
-      if ( !set->read( fname, add, tokDebug, theErrLog ) ){
+    }
+    for ( const auto& m : messages ){
+      if ( !m.str().empty() ){
+	LOG << m.str() << flush;
+      }
+    }
+    Setting *default_set = 0;
+    for ( size_t i = 0; i < languages.size(); ++i ){
+      if ( errors[i] ){
+	for ( size_t j = i+1; j < languages.size(); ++j ){
+	  delete sets[j];
+	}
+	rethrow_exception( errors[i] );
+      }
+      const string& lang = languages[i];
+      Setting *set = sets[i];
+      if ( set && default_set == 0 && i > 0 ){
+	if ( !tname.empty() ){
+	  delete set;
+	  set = new Setting();
+	  set->rule_cache = rule_cache;
+	  if ( !set->read( "tokconfig-" + lang, tname, tokDebug, theErrLog ) ){
+	    delete set;
+	    set = 0;
+	  }
+	}
+	else {
+	  set->compile();
+	}
+      }
+      if ( !set ){
 	LOG << "problem reading datafile for language: " << lang << endl;
 	LOG << "Unsupported language (Did you install the uctodata package?)"
 	    << endl;
@@ -2499,6 +3668,21 @@ namespace Tokenizer {
       cerr << "ucto: No useful settingsfile(s) could be found." << endl;
       return false;
     }
+    // don't waste time on guessing languages we can't handle anyway
+    vector<string> old_languages = tc_languages;
+    tc_languages.clear();
+    for ( const auto& lang : languages ){
+      if ( settings.find( lang ) != settings.end() ){
+	tc_languages.push_back( lang );
+      }
+    }
+    if ( tc ){
+      tc->set_languages( tc_languages );
+    }
+    if ( lang_cache && tc_languages != old_languages ){
+      // cached guesses may be languages that aren't loaded anymore
+      lang_cache->clear();
+    }
     return true;
   }
 
@@ -79,6 +79,35 @@ void usage(){
        << "\t--filterpunct     - remove all punctuation from the output" << endl
        << "\t--uselanguages=<lang1,lang2,..langn> - Using FoLiA input, only tokenize strings in these languages. Default = 'lang1'" << endl
        << "\t--detectlanguages=<lang1,lang2,..langn> - try to assign a language to each line of text input. Default = 'lang1'" << endl
+       << "\t--detectunit=[line|paragraph|document|<n>] - the unit of text input" << endl
+       << "\t                    to detect the language of. (default 'line')" << endl
+       << "\t                    <n> means: every n characters. The first 256" << endl
+       << "\t                    characters of a unit decide its language, the" << endl
+       << "\t                    lines before that get the guess so far." << endl
+       << "\t--stickylanguage  - keep the current language as long as the language" << endl
+       << "\t                    detection isn't confident about another one. A" << endl
+       << "\t                    confident guess is only checked every 5000 characters." << endl
+       << "\t--lazyload        - with multiple languages, only read the settings of" << endl
+       << "\t                    a language when it is first needed." << endl
+       << "\t--rule-timelimit=N - give up matching a rule on a word after about" << endl
+       << "\t                    N milliseconds (ICU match steps). The rule is" << endl
+       << "\t                    then treated as not matching. (default 0: no limit)" << endl
+       << "\t--line-budget=ms  - when tokenizing a line takes more than 'ms'" << endl
+       << "\t                    milliseconds, split the rest of it on spaces only." << endl
+       << "\t                    0 means: split every line on spaces only." << endl
+       << "\t                    (default: no budget)" << endl
+       << "\t--linechunk=bytes - read lines of over 'bytes' bytes in pieces, cut" << endl
+       << "\t                    at spaces. Each piece is tokenized as a line, so" << endl
+       << "\t                    a cut may end a sentence or split a word." << endl
+       << "\t                    (default 0: whole lines)" << endl
+       << "\t--longwords=[line|skip|chunk] - what to do with words of over 2500" << endl
+       << "\t                    characters: skip the line, skip the word or split" << endl
+       << "\t                    it in pieces of type LONGWORD. (default 'line')" << endl
+       << "\t--slowlog='file'  - write the lines that take more than 100 ms to" << endl
+       << "\t                    tokenize to 'file'. (see the man page)" << endl
+       << "\t--slowlog-ms=ms   - use 'ms' as the threshold for --slowlog" << endl
+       << "\t--profile-rules   - count attempts, matches and time per rule, and" << endl
+       << "\t                    the recursion depth of words. Printed at the end." << endl
        << "\t--add-tokens='file' - add additional tokens to the [TOKENS] of the" << endl
        << "\t                    default language. TOKENS are always kept intact." << endl
        << "\t-P                - Disable paragraph detection" << endl
@@ -87,6 +116,9 @@ void usage(){
        << "\t-x <DocID>        - Output FoLiA XML, use the specified Document ID (obsolete)" << endl
        << "\t-F                - Input file is in FoLiA XML. All untokenised sentences will be tokenised." << endl
        << "\t                    -F is automatically set when inputfile has extension '.xml'" << endl
+       << "\t--stream          - Process FoLiA input element by element, without loading" << endl
+       << "\t                    the whole document in memory. (for huge documents)" << endl
+       << "\t--threads=<n>     - Use n threads to tokenize FoLiA input. (default 1)" << endl
        << "\t-X                - Output FoLiA XML, use the Document ID specified with --id=" << endl
        << "\t--id <DocID>      - use the specified Document ID to label the FoLia doc." << endl
        << "                      -X is automatically set when inputfile has extension '.xml'" << endl
@@ -105,6 +137,16 @@ int main( int argc, char *argv[] ){
   bool paragraphdetection = true;
   bool quotedetection = false;
   bool do_language_detect = false;
+  string detect_unit = "line";
+  bool sticky_lang = false;
+  bool lazy_settings = false;
+  bool profile_rules = false;
+  int rule_time_limit = 0;
+  double line_budget = -1.0;
+  string long_words = "line";
+  size_t line_chunk = 0;
+  string slow_log;
+  double slow_ms = 100.0;
   bool dofiltering = true;
   bool dopunctfilter = false;
   bool xmlin = false;
@@ -123,13 +165,15 @@ int main( int argc, char *argv[] ){
   string ofile;
   string c_file;
   bool passThru = false;
+  bool streaming = false;
+  int num_threads = 1;
   bool sentencesplit = false;
   string norm_set_string;
   string add_tokens;
 
   try {
     TiCC::CL_Options Opts( "d:e:fhlPQunmN:vVL:c:s:x:FXT:",
-			   "filter:,filterpunct,passthru,textclass:,inputclass:,outputclass:,normalize:,id:,version,help,detectlanguages:,uselanguages:,textredundancy:,add-tokens:,split");
+			   "filter:,filterpunct,passthru,textclass:,inputclass:,outputclass:,normalize:,id:,version,help,detectlanguages:,uselanguages:,textredundancy:,add-tokens:,split,stream,threads:,detectunit:,stickylanguage,lazyload,profile-rules,rule-timelimit:,line-budget:,linechunk:,longwords:,slowlog:,slowlog-ms:");
     Opts.init(argc, argv );
     if ( Opts.extract( 'h' )
 	 || Opts.extract( "help" ) ){
@@ -185,6 +229,10 @@ int main( int argc, char *argv[] ){
       //      sentenceperlineoutput = true;
     }
     passThru = Opts.extract( "passthru" );
+    streaming = Opts.extract( "stream" );
+    sticky_lang = Opts.extract( "stickylanguage" );
+    lazy_settings = Opts.extract( "lazyload" );
+    profile_rules = Opts.extract( "profile-rules" );
     string textclass;
     Opts.extract( "textclass", textclass );
     Opts.extract( "inputclass", inputclass );
@@ -205,6 +253,35 @@ int main( int argc, char *argv[] ){
     }
     Opts.extract( "add-tokens", add_tokens );
     string value;
+    if ( Opts.extract( "rule-timelimit", value )
+	 && ( !TiCC::stringTo( value, rule_time_limit )
+	      || rule_time_limit < 0 ) ){
+      throw TiCC::OptionError( "invalid value for --rule-timelimit: " + value );
+    }
+    if ( Opts.extract( "line-budget", value )
+	 && ( !TiCC::stringTo( value, line_budget )
+	      || line_budget < 0 ) ){
+      throw TiCC::OptionError( "invalid value for --line-budget: " + value );
+    }
+    if ( Opts.extract( "linechunk", value )
+	 && !TiCC::stringTo( value, line_chunk ) ){
+      throw TiCC::OptionError( "invalid value for --linechunk: " + value );
+    }
+    if ( Opts.extract( "longwords", long_words )
+	 && long_words != "line"
+	 && long_words != "skip"
+	 && long_words != "chunk" ){
+      throw TiCC::OptionError( "invalid value for --longwords: " + long_words );
+    }
+    Opts.extract( "slowlog", slow_log );
+    if ( Opts.extract( "slowlog-ms", value ) ){
+      if ( !TiCC::stringTo( value, slow_ms ) || slow_ms < 0 ){
+	throw TiCC::OptionError( "invalid value for --slowlog-ms: " + value );
+      }
+      if ( slow_log.empty() ){
+	throw TiCC::OptionError( "--slowlog-ms is only valid with --slowlog" );
+      }
+    }
     if ( Opts.extract( "filter", value ) ){
       bool result;
       if ( !TiCC::stringTo( value, result ) ){
@@ -234,6 +311,11 @@ int main( int argc, char *argv[] ){
 	throw TiCC::OptionError( "invalid value for -d: " + value );
       }
     }
+    if ( Opts.extract( "threads", value ) ){
+      if ( !TiCC::stringTo(value,num_threads) || num_threads < 1 ){
+	throw TiCC::OptionError( "invalid value for --threads: " + value );
+      }
+    }
     bool use_lang = Opts.is_present( "uselanguages" );
     bool detect_lang = Opts.is_present( "detectlanguages" );
     if ( Opts.is_present('L') ) {
@@ -331,6 +413,31 @@ int main( int argc, char *argv[] ){
     if ( use_lang && !xmlin ){
       throw TiCC::OptionError( "--uselanguages is only valid for FoLiA input" );
     }
+    if ( streaming && !xmlin ){
+      throw TiCC::OptionError( "--stream is only valid for FoLiA input" );
+    }
+    if ( num_threads > 1 && !xmlin ){
+      throw TiCC::OptionError( "--threads is only valid for FoLiA input" );
+    }
+    if ( num_threads > 1 && streaming ){
+      throw TiCC::OptionError( "--threads can't be combined with --stream" );
+    }
+    if ( Opts.extract( "detectunit", detect_unit ) ){
+      size_t chars = 0;
+      if ( detect_unit != "line"
+	   && detect_unit != "paragraph"
+	   && detect_unit != "document"
+	   && ( !TiCC::stringTo( detect_unit, chars ) || chars == 0 ) ){
+	throw TiCC::OptionError( "invalid value for --detectunit: "
+				 + detect_unit );
+      }
+      if ( !do_language_detect ){
+	throw TiCC::OptionError( "--detectunit is only valid with --detectlanguages" );
+      }
+    }
+    if ( sticky_lang && !do_language_detect ){
+      throw TiCC::OptionError( "--stickylanguage is only valid with --detectlanguages" );
+    }
     if ( files.size() == 2 ){
       ofile = files[1];
       if ( TiCC::match_back( ofile, ".xml" ) ){
@@ -439,6 +546,15 @@ int main( int argc, char *argv[] ){
     TokenizerClass tokenizer;
     // set debug first, so init() can be debugged too
     tokenizer.setDebug( debug );
+    tokenizer.setLazySettings( lazy_settings );
+    tokenizer.setRuleProfiling( profile_rules );
+    tokenizer.setRuleTimeLimit( rule_time_limit );
+    tokenizer.setLineBudget( line_budget );
+    tokenizer.setLongWordPolicy( long_words );
+    tokenizer.setLineChunkSize( line_chunk );
+    if ( !tokenizer.setSlowLog( slow_log, slow_ms ) ){
+      throw runtime_error( "unable to open slow input log: " + slow_log );
+    }
     if ( passThru ){
       tokenizer.setPassThru( true );
     }
@@ -479,14 +595,23 @@ int main( int argc, char *argv[] ){
     tokenizer.setInputEncoding( inputEncoding );
     tokenizer.setFiltering(dofiltering);
     tokenizer.setLangDetection(do_language_detect);
+    tokenizer.setLangDetectUnit(detect_unit);
+    tokenizer.setStickyLang(sticky_lang);
     tokenizer.setPunctFilter(dopunctfilter);
     tokenizer.setInputClass(inputclass);
     tokenizer.setOutputClass(outputclass);
     tokenizer.setXMLOutput(xmlout, docid);
     tokenizer.setXMLInput(xmlin);
+    tokenizer.setStreaming(streaming);
+    tokenizer.setNumThreads(num_threads);
     tokenizer.setTextRedundancy(redundancy);
 
-    if (xmlin) {
+    if ( xmlin && streaming ){
+      tokenizer.tokenizeStreaming( ifile, *OUT );
+      if ( OUT != &cout )
+	delete OUT;
+    }
+    else if (xmlin) {
       folia::Document doc;
       doc.readFromFile(ifile);
       tokenizer.tokenize(doc);
@@ -498,6 +623,19 @@ int main( int argc, char *argv[] ){
       if ( IN != &cin )
 	delete IN;
     }
+    if ( profile_rules ){
+      cerr << "ucto: rule profile:" << endl;
+      tokenizer.printRuleProfile( cerr );
+    }
+    if ( verbose ){
+      cerr << "ucto: " << tokenizer.getStats() << endl;
+    }
+    size_t hits, misses;
+    if ( verbose && do_language_detect
+	 && tokenizer.getLangCacheStats( hits, misses ) ){
+      cerr << "ucto: language cache: " << hits << " hits, "
+	   << misses << " misses" << endl;
+    }
   }
   catch ( exception &e ){
     cerr << "ucto: " << e.what() << endl;
@@ -0,0 +1,361 @@
+/*
+  Copyright (c) 2006 - 2018
+  CLST - Radboud University
+  ILK  - Tilburg University
+
+  This file is part of Ucto
+
+  Ucto is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  Ucto is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  For questions and suggestions, see:
+      https://github.com/LanguageMachines/ucto/issues
+  or send mail to:
+      lamasoftware (at ) science.ru.nl
+*/
+
+// A benchmark harness for the tokenizer. It runs a set of cases over a
+// corpus and reports the results as JSON on stdout, so they can be
+// compared between versions. Use it as:
+//   ucto_bench [-L lang] [--languages=l1,l2,..] [--size=MB] [--cases=c1,..]
+//              corpus-files...
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "config.h"
+#include "ticcutils/StringOps.h"
+#include "ticcutils/CommandLine.h"
+#include "libfolia/folia.h"
+#include "ucto/tokenize.h"
+
+using namespace std;
+using namespace Tokenizer;
+
+typedef chrono::steady_clock bench_clock;
+
+class counting_buf: public streambuf {
+  // an output buffer that throws everything away, but counts the bytes
+public:
+  counting_buf(): count(0) {};
+  size_t count;
+protected:
+  int overflow( int c ) {
+    ++count;
+    return c;
+  }
+  streamsize xsputn( const char *, streamsize n ){
+    count += n;
+    return n;
+  }
+};
+
+struct bench_result {
+  string name;
+  double init_sec;
+  size_t bytes;
+  size_t out_bytes;
+  size_t tokens;
+  size_t sentences;
+  double seconds;
+  vector<double> latencies; // microseconds per call of tokenizeStream
+};
+
+double seconds_since( const bench_clock::time_point& start ){
+  return chrono::duration<double>( bench_clock::now() - start ).count();
+}
+
+long peak_rss_kb(){
+  struct rusage usage;
+  if ( getrusage( RUSAGE_SELF, &usage ) != 0 ){
+    return -1;
+  }
+  return usage.ru_maxrss;
+}
+
+double percentile( const vector<double>& sorted, double p ){
+  if ( sorted.empty() ){
+    return 0.0;
+  }
+  size_t pos = size_t( p * ( sorted.size() - 1 ) );
+  return sorted[pos];
+}
+
+string json_escape( const string& s ){
+  string result;
+  for ( const auto c : s ){
+    if ( c == '"' || c == '\\' ){
+      result += '\\';
+      result += c;
+    }
+    else if ( (unsigned char)c < 0x20 ){
+      char buf[8];
+      snprintf( buf, sizeof(buf), "\\u%04x", (unsigned char)c );
+      result += buf;
+    }
+    else {
+      result += c;
+    }
+  }
+  return result;
+}
+
+const vector<string> known_cases = { "plain", "quotes", "sentenceperline",
+				     "passthru", "filterpunct", "folia_out",
+				     "folia_in", "detectlanguages" };
+
+bool setup( TokenizerClass& tok,
+	    const string& name,
+	    const vector<string>& languages,
+	    const vector<string>& detect_languages ){
+  // configure tok for the case 'name'. returns false on init failure
+  if ( name == "passthru" ){
+    tok.setPassThru( true );
+    return true;
+  }
+  if ( name == "detectlanguages" ){
+    tok.setLangDetection( true );
+    return tok.init( detect_languages );
+  }
+  if ( name == "quotes" ){
+    tok.setQuoteDetection( true );
+  }
+  else if ( name == "sentenceperline" ){
+    tok.setSentencePerLineOutput( true );
+  }
+  else if ( name == "filterpunct" ){
+    tok.setPunctFilter( true );
+  }
+  else if ( name == "folia_out" ){
+    tok.setXMLOutput( true, "bench" );
+  }
+  else if ( name == "folia_in" ){
+    tok.setXMLInput( true );
+    tok.setXMLOutput( true, "bench" );
+  }
+  else if ( name != "plain" ){
+    throw runtime_error( "unknown case: " + name );
+  }
+  return tok.init( languages );
+}
+
+string make_folia( const string& corpus ){
+  // create an untokenized FoLiA file with a paragraph per block of text.
+  // returns its name
+  folia::Document doc( "id='bench'" );
+  doc.declare( folia::AnnotationType::PARAGRAPH, "" );
+  folia::Text *text = new folia::Text( folia::getArgs( "id='bench.text'" ) );
+  doc.append( text );
+  istringstream is( corpus );
+  string line;
+  string par;
+  int count = 0;
+  while ( true ){
+    bool more = bool( getline( is, line ) );
+    if ( more && !line.empty() ){
+      if ( !par.empty() ){
+	par += " ";
+      }
+      par += line;
+      continue;
+    }
+    if ( !par.empty() ){
+      folia::KWargs args;
+      args["id"] = "bench.p." + TiCC::toString( ++count );
+      folia::Paragraph *p = new folia::Paragraph( args, &doc );
+      text->append( p );
+      p->settext( par );
+      par.clear();
+    }
+    if ( !more ){
+      break;
+    }
+  }
+  string name = "/tmp/ucto_bench_" + TiCC::toString( getpid() ) + ".xml";
+  doc.save( name );
+  return name;
+}
+
+bench_result run_case( const string& name,
+		       const string& corpus,
+		       const vector<string>& languages,
+		       const vector<string>& detect_languages ){
+  bench_result result;
+  result.name = name;
+  result.bytes = corpus.size();
+  result.out_bytes = 0;
+  result.tokens = 0;
+  result.sentences = 0;
+  auto start = bench_clock::now();
+  TokenizerClass tok;
+  if ( !setup( tok, name, languages, detect_languages ) ){
+    throw runtime_error( "init failed for case: " + name );
+  }
+  result.init_sec = seconds_since( start );
+  counting_buf buf;
+  ostream out( &buf );
+  if ( name == "folia_in" ){
+    // only the tokenization is timed, not creating the input
+    string in_file = make_folia( corpus );
+    start = bench_clock::now();
+    folia::Document doc;
+    doc.readFromFile( in_file );
+    tok.tokenize( doc );
+    out << doc;
+    result.seconds = seconds_since( start );
+    remove( in_file.c_str() );
+  }
+  else {
+    // first end-to-end, including the output
+    istringstream is( corpus );
+    start = bench_clock::now();
+    tok.tokenize( is, out );
+    result.seconds = seconds_since( start );
+  }
+  result.out_bytes = buf.count;
+  // the counts of the timed run
+  TokenizerStats stats = tok.getStats();
+  result.tokens = stats.tokens;
+  result.sentences = stats.sentences;
+  if ( name != "folia_in" && name != "folia_out" ){
+    // then sentence by sentence, to get the latencies
+    istringstream is( corpus );
+    tok.reset();
+    while ( is ){
+      auto s_start = bench_clock::now();
+      vector<Token> v = tok.tokenizeStream( is );
+      result.latencies.push_back( seconds_since( s_start ) * 1e6 );
+    }
+  }
+  return result;
+}
+
+void report( ostream& os, const vector<bench_result>& results,
+	     const string& corpus_names ){
+  os << "{" << endl;
+  os << "  \"version\": \"" << VERSION << "\"," << endl;
+  os << "  \"corpus\": \"" << json_escape( corpus_names ) << "\"," << endl;
+  os << "  \"cases\": [" << endl;
+  for ( size_t i=0; i < results.size(); ++i ){
+    const bench_result& r = results[i];
+    vector<double> lat = r.latencies;
+    sort( lat.begin(), lat.end() );
+    double mb = r.bytes / ( 1024.0 * 1024.0 );
+    os << "    { \"name\": \"" << r.name << "\","
+       << " \"init_sec\": " << r.init_sec << ","
+       << " \"bytes\": " << r.bytes << ","
+       << " \"output_bytes\": " << r.out_bytes << ","
+       << " \"seconds\": " << r.seconds << ","
+       << " \"mb_per_sec\": " << ( r.seconds > 0 ? mb / r.seconds : 0 ) << ","
+       << " \"tokens\": " << r.tokens << ","
+       << " \"sentences\": " << r.sentences << ","
+       << " \"tokens_per_sec\": "
+       << ( r.seconds > 0 ? r.tokens / r.seconds : 0 ) << ","
+       << " \"latency_us\": { \"p50\": " << percentile( lat, 0.5 )
+       << ", \"p90\": " << percentile( lat, 0.9 )
+       << ", \"p99\": " << percentile( lat, 0.99 )
+       << ", \"max\": " << ( lat.empty() ? 0 : lat.back() ) << " },"
+       // getrusage only knows the peak of the whole process so far
+       << " \"peak_rss_kb\": " << peak_rss_kb() << " }"
+       << ( i+1 < results.size() ? "," : "" ) << endl;
+  }
+  os << "  ]" << endl;
+  os << "}" << endl;
+}
+
+int main( int argc, char *argv[] ){
+  string language = "nld";
+  string detect = "nld,eng,deu,fra";
+  string case_list = "plain,quotes,sentenceperline,passthru,filterpunct,"
+    "folia_out,folia_in,detectlanguages";
+  size_t size_mb = 5;
+  vector<string> files;
+  try {
+    TiCC::CL_Options Opts( "L:h", "languages:,size:,cases:,help" );
+    Opts.init( argc, argv );
+    if ( Opts.extract( 'h' ) || Opts.extract( "help" ) ){
+      cerr << "Usage: ucto_bench [-L lang] [--languages=l1,l2,..] "
+	   << "[--size=MB] [--cases=c1,c2,..] corpus-files..." << endl
+	   << "\tcases: " << case_list << endl;
+      return EXIT_SUCCESS;
+    }
+    Opts.extract( 'L', language );
+    Opts.extract( "languages", detect );
+    Opts.extract( "cases", case_list );
+    string value;
+    if ( Opts.extract( "size", value )
+	 && ( !TiCC::stringTo( value, size_mb ) || size_mb == 0 ) ){
+      throw TiCC::OptionError( "invalid value for --size: " + value );
+    }
+    files = Opts.getMassOpts();
+    if ( files.empty() ){
+      throw TiCC::OptionError( "missing corpus file(s)" );
+    }
+    vector<string> parts;
+    TiCC::split_at( case_list, parts, "," );
+    for ( const auto& c : parts ){
+      if ( find( known_cases.begin(), known_cases.end(), c )
+	   == known_cases.end() ){
+	throw TiCC::OptionError( "unknown case in --cases: " + c );
+      }
+    }
+  }
+  catch ( const TiCC::OptionError& e ){
+    cerr << "ucto_bench: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  // build the corpus: the files, repeated until it has the wanted size
+  string base;
+  string corpus_names;
+  for ( const auto& f : files ){
+    ifstream is( f );
+    if ( !is ){
+      cerr << "ucto_bench: unable to read " << f << endl;
+      return EXIT_FAILURE;
+    }
+    base += string( istreambuf_iterator<char>( is ),
+		    istreambuf_iterator<char>() );
+    base += "\n\n";
+    corpus_names += ( corpus_names.empty() ? "" : "," ) + f;
+  }
+  string corpus;
+  while ( !base.empty() && corpus.size() < size_mb * 1024 * 1024 ){
+    corpus += base;
+  }
+  vector<string> languages = { language };
+  vector<string> detect_languages;
+  vector<string> cases;
+  TiCC::split_at( detect, detect_languages, "," );
+  TiCC::split_at( case_list, cases, "," );
+  vector<bench_result> results;
+  try {
+    for ( const auto& c : cases ){
+      cerr << "ucto_bench: running " << c << endl;
+      results.push_back( run_case( c, corpus, languages, detect_languages ) );
+    }
+  }
+  catch ( const exception& e ){
+    cerr << "ucto_bench: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  report( cout, results, corpus_names );
+  return EXIT_SUCCESS;
+}